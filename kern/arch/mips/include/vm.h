@@ -117,10 +117,11 @@ paddr_t ram_getfirstfree(void);
  */
 
 struct tlbshootdown {
-	/*
-	 * Change this to what you need for your VM design.
-	 */
-	int ts_placeholder;
+	/* translation to remove: page and ASID of its address space */
+	uint32_t ts_asid;
+	vaddr_t ts_vaddr;
+	/* set by the target cpu when done */
+	volatile int *ts_done;
 };
 
 #define TLBSHOOTDOWN_MAX 16
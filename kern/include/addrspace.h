@@ -38,10 +38,12 @@
 #include "opt-dumbvm.h"
 #include "opt-paging.h"
 #include <pt.h>
+#include <elf.h>
 
 #define DUMBVM_STACKPAGES 18
 
 struct vnode;
+struct cpu;
 
 /*
  * Address space - data structure associated with the virtual memory
@@ -67,6 +69,15 @@ struct addrspace
         size_t as_npages1;
         vaddr_t as_vbase2;
         size_t as_npages2;
+        /* executable, kept open for on-demand loading of its pages */
+        struct vnode *as_vnode;
+        /* program headers of the executable, read once by load_elf() */
+        Elf_Phdr *as_ph;
+        int as_phnum;
+        /* TLB address space id, valid on cpu as_asid_cpu while as_asid_gen is current */
+        uint32_t as_asid;
+        uint32_t as_asid_gen;
+        struct cpu *as_asid_cpu;
 #endif
 };
 
@@ -127,7 +138,7 @@ int as_define_region(struct addrspace *as,
                      int writeable,
                      int executable);
 #if OPT_PAGING
-int as_prepare_load(unsigned npages);
+int as_prepare_load(unsigned npages, int intent);
 int isTableActive(void);
 #else
 int as_prepare_load(struct addrspace *as);
@@ -3,11 +3,54 @@
 
 #include <types.h>
 
-int init_freeRamFrames(int nRamFrames);
-int init_allocSize(int nRamFrames);
-void destroy_freeRamFrames(void);
-void print_freeRamFrames(void);
-int freeppages(paddr_t addr, long npages);
-paddr_t getppages(unsigned long npages, int kmem);
+/* largest block of the buddy allocator: 2^10 frames (4 MB) */
+#define BUDDY_MAX_ORDER 10
+
+/* state of a frame in the coremap */
+#define CM_USED 0   /* allocated, or not the first frame of a free block */
+#define CM_FREE 1   /* first frame of a free block, on the list of its order */
+#define CM_ZEROED 2 /* free and zero-filled, on the list of pre-zeroed frames */
+
+struct coremap_entry
+{
+    /* free list of the block order (or list of zeroed frames), -1 terminated */
+    int next, prev;
+    /* first frame of an allocated block: number of frames allocated */
+    int npages;
+    /* first frame of a free block: its order */
+    unsigned char order;
+    unsigned char state;
+};
+
+int init_coremap(int nRamFrames);
+void print_free_frames(void);
+/* free the block starting at addr, whose frame index is first_page: returns how many frames it had */
+int freeppages(paddr_t addr, long first_page);
+/*
+ * allocation intent: ALLOC_ZERO for frames that must be zero-filled,
+ * ALLOC_OVERWRITE for frames the caller overwrites completely (swap-in,
+ * whole-page ELF reads, copies), which are not zeroed
+ */
+#define ALLOC_ZERO 0
+#define ALLOC_OVERWRITE 1
+/* maximum number of free frames kept zero-filled by the pagezero thread */
+#define PAGEZERO_POOL 32
+/*
+ * free frames cached by each cpu, so that single frames are allocated and
+ * freed without the global lock; they are taken from the buddy lists, and
+ * given back, MAGAZINE_BATCH at a time
+ */
+#define MAGAZINE_SIZE 16
+#define MAGAZINE_BATCH 8
+
+paddr_t getppages(unsigned long npages, int kmem, int intent);
+/* a free frame, if any: never swaps out */
+paddr_t getfreeppage(void);
+/* number of free frames (read without locks: only a hint) */
+int count_free_frames(void);
+/* evict up to max (<= SWAP_CLUSTER) user frames, returns how many */
+int evict_pages(paddr_t *victims, int max);
+void release_evicted_page(paddr_t paddr);
+void pagezero_bootstrap(void);
 
 #endif
\ No newline at end of file
@@ -12,6 +12,20 @@
 #define SWAP_OUT_PAGE 7
 #define SWAP_IN_PAGE 8
 #define NEW_PAGE_ZEROED 9 //OK
+#define COW_FAULT 10
+#define SWAP_OUT_IO 11
+#define SWAP_IN_IO 12
+#define SWAP_READAHEAD 13
+#define PAGEOUT_WAKEUP 14
+#define PAGEOUT_PAGE 15
+#define PAGE_PREZEROED 16
+#define PREZEROED_USED 17
+#define STLB_HIT 18
+#define SWAP_CLEAN_DROP 19
+#define ZERO_PAGE_MAP 20
+#define CLEAN_PAGE_WRITE 21
+#define ELF_READAROUND 22
+#define FAULT_AROUND_MAP 23
 
 
 
@@ -0,0 +1,20 @@
+#ifndef _PAGEOUT_H
+#define _PAGEOUT_H
+
+/*
+ * Pageout daemon: a kernel thread that evicts pages ahead of demand,
+ * so that faults find a free frame. It is woken when the free frames
+ * drop below the low watermark and works until they reach the high one.
+ */
+
+/* default watermarks, in frames */
+#define PAGEOUT_LOW 8
+#define PAGEOUT_HIGH 24
+
+void pageout_bootstrap(void);
+void pageout_wakeup(void);
+int pageout_low_watermark(void);
+int pageout_set_watermarks(int low, int high);
+void pageout_print_watermarks(void);
+
+#endif
@@ -46,6 +46,9 @@ struct addrspace;
 struct thread;
 struct vnode;
 
+/* pids go from 1 to MAX_PROC - 1 */
+#define MAX_PROC 100
+
 /*
  * Process structure.
  *
@@ -86,7 +89,6 @@ struct proc
 #if OPT_PAGING
 	Elf_Ehdr p_eh;
 	struct openfile *fileTable[OPEN_MAX];
-	int last_victim;
 #endif
 };
 
@@ -16,16 +16,109 @@
  * and the MSB is used as valid/invalid bit (set with VALID_MASK)
  */
 
+struct vnode;
+
+/*
+ * Entry of the frame with the same index. The page mapped in the frame and
+ * its flags are packed in key:
+ *   bits 31-12: page number, bits 11-5: pid of the owner, bits 4-0: flags
+ * Free frames have pid -1 and kernel frames -2, that is IPT_PID_FREE and
+ * IPT_PID_KERNEL once truncated to the pid field.
+ * The frames whose key hashes to the same bucket are chained through next.
+ */
 struct ipt_entry{
-pid_t pid;
-vaddr_t vaddr;
+uint32_t key;
+/* next entry in the hash chain, -1 if last (see struct ipt_alias) */
+int next;
+/* shared and text frames: their struct ipt_share, -1 if none */
+int share;
+/* list of the mappings of the owner */
+int proc_next;
+int proc_prev;
+};
+
+/*
+ * What only frames mapped by several processes, or holding text, need:
+ * kept apart, and allocated on demand, so that private frames do not pay
+ * for it.
+ */
+struct ipt_share{
+/* other processes mapping the frame after a copy-on-write fork: first alias, -1 if none */
+int alias;
+/* text frames: next frame in the text hash chain and executable they come from (NULL otherwise) */
+int next_text;
+struct vnode *vn;
+};
+
+/*
+ * A frame shared copy-on-write is mapped by several processes at the same
+ * vaddr: the owner is in the frame entry, every other process has an alias,
+ * with the same key layout and chained in the same hash. Hash chains hold
+ * frame indexes (less than the number of frames) and, from the number of
+ * frames on, alias indexes shifted by it.
+ */
+struct ipt_alias{
+uint32_t key;
+/* next entry in the hash chain, or in the free list */
+int next;
+/* frame mapped and next alias of the same frame */
+int frame;
+int sibling;
+/* list of the mappings of the process */
+int proc_next;
+int proc_prev;
 };
+
+/* layout of the key of ipt entries and aliases */
+#define IPT_FLAGS 0x1f
+#define IPT_PID_SHIFT 5
+#define IPT_PID_MASK 0x7f
+#define IPT_PID_FREE 0x7f
+#define IPT_PID_KERNEL 0x7e
+
+/* flags of an ipt entry */
+#define IPT_BUSY 0x1   /* frame locked: being loaded, used or swapped out, wait before using it */
+#define IPT_SHARED 0x2 /* returned by ipt_lookup_flags: frame mapped copy-on-write */
+#define IPT_REF 0x4    /* frame used since the last sweep of the clock hand */
+#define IPT_CLEAN 0x8  /* frame not written since it was read from the swapfile or the ELF file */
+
+/*
+ * Mappings available for each frame, counting the owner. Frames shared
+ * copy-on-write need an alias for each process mapping them but the owner.
+ */
+#define IPT_SHARE_FACTOR 4
+
+/* chain lengths counted one by one by hash_print, the last slot counts the longer ones */
+#define HASH_HISTOGRAM_SIZE 8
+
 void print_ipt(void);
 paddr_t get_victim(vaddr_t *vaddr, pid_t *pid);
 int create_ipt(void);
 
 /* Given a pid and vaddr, get the physical frame, if in memory */
 paddr_t ipt_lookup(pid_t pid, vaddr_t vaddr);
+/* same as ipt_lookup, also returning IPT_BUSY/IPT_SHARED/IPT_CLEAN in flags */
+paddr_t ipt_lookup_flags(pid_t pid, vaddr_t vaddr, int *flags);
+/* lock a resident frame (waiting if someone else holds it) and unlock it */
+paddr_t ipt_lock_frame(pid_t pid, vaddr_t vaddr, int *flags);
+void ipt_unlock_frame(paddr_t paddr);
+/* same as ipt_lock_frame, but give up (return 0) if the frame is busy */
+paddr_t ipt_trylock_frame(pid_t pid, vaddr_t vaddr, int *flags);
+/* whether a frame still has the same content as its swapfile slots */
+void ipt_set_clean(paddr_t paddr, int clean);
+int ipt_is_clean(paddr_t paddr);
+/* map all the resident data and stack frames of old_pid also in new_pid, copy-on-write */
+int ipt_share_process(pid_t old_pid, pid_t new_pid);
+/* remove the mapping of pid from a shared frame */
+void ipt_unshare(pid_t pid, paddr_t paddr, vaddr_t vaddr);
+/* iterate over the processes mapping a frame selected as victim */
+pid_t ipt_next_sharer(paddr_t paddr, pid_t pid);
+void ipt_release_victim(paddr_t paddr);
+/* text frames shared by all the processes running the same executable */
+int ipt_text_lookup(pid_t pid, struct vnode *vn, vaddr_t vaddr, paddr_t *paddr);
+int ipt_text_add(pid_t pid, paddr_t paddr, vaddr_t vaddr, struct vnode *vn);
+/* a frame added locked could not be loaded: unmap it before freeing it */
+void ipt_drop_frame(paddr_t paddr);
 /* set an entry in the ipt */
 int ipt_add(pid_t pid, paddr_t paddr, vaddr_t vaddr);
 int ipt_kadd(pid_t pid, paddr_t paddr, vaddr_t vaddr);
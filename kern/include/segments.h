@@ -2,7 +2,10 @@
 #define _SEGMENTS_H
 
 
-int load_page(vaddr_t page, vaddr_t vaddr, int segment, paddr_t paddr);
+/* read n pages of a segment, the faulting one and the following ones, in the frames paddr */
+int load_pages(vaddr_t page, int segment, paddr_t *paddr, int n);
+int load_page_fills_frame(vaddr_t page, int segment);
+int load_page_is_zero(vaddr_t page, int segment);
 
 
 #endif
\ No newline at end of file
@@ -5,28 +5,83 @@
 #include <opt-list.h>
 #include <vm.h>
 
+/*
+ * Pages are swapped to the raw disks in SWAP_DEVICES that are there and not
+ * mounted, each one with a priority ({ name, priority }): pages go to the
+ * devices with the highest priority as long as they have room, striped over
+ * the ones with the same priority. The swap area is as large as the disks.
+ * With no disk, pages go to a SWAPFILE of MAX_SIZE bytes, on the root file
+ * system.
+ */
+#define SWAP_DEVICES { { "lhd0", 1 }, { "lhd1", 1 } }
+#define MAX_SWAP_DEVICES 4
 #define MAX_SIZE 1024 * 1024 * 9
-#define ENTRIES (MAX_SIZE / PAGE_SIZE)
 
+struct swap_device;
+
+/*
+ * A swapped out page of a process. The slot of the swapfile holding it is
+ * shared by the processes forked after it was written: each of them has an
+ * entry referring to it, and the slot is freed with the last one.
+ */
 struct swap_entry
 {
 
     pid_t pid;
     vaddr_t page;
     #if OPT_LIST
-    off_t file_offset;
+    struct swap_slot *slot;
     struct swap_entry *next, *previous;
+    /* next entry in the same bucket of the (pid, page) hash */
+    struct swap_entry *hash_next;
+    #else
+    int slot;
+    /* next entry in the same bucket of the (pid, page) hash, -1 if last */
+    int next;
     #endif
 
 };
 
+#if OPT_LIST
+struct swap_slot
+{
+    struct swap_device *dev;
+    /* offset on the device */
+    off_t file_offset;
+    /* number of entries referring to the slot */
+    int refs;
+    /* next free slot */
+    struct swap_slot *next;
+};
+#endif
+
+/* maximum number of pages moved with a single I/O operation on the swapfile */
+#define SWAP_CLUSTER 8
+
+/* a page to be written to the swapfile */
+struct swap_page
+{
+    paddr_t paddr;
+    vaddr_t vaddr;
+    pid_t pid;
+};
+
 void init_swapfile(void);
 int swap_in(vaddr_t page, paddr_t paddr);
+int swap_present(pid_t pid, vaddr_t page);
+void swap_discard(pid_t pid, vaddr_t page);
 int swap_out(paddr_t paddr, vaddr_t vaddr, int segment_victim, pid_t pid_victim);
+int swap_out_cluster(struct swap_page *pages, int n);
 
 void free_swap_table(pid_t pid);
 void print_swap(void);
+/* write a page, evicted from the compressed pool, to its slot */
+int swap_write_slot(int slot, paddr_t paddr);
+/* slots and I/O of each swap device, for the VM statistics */
+void print_swap_devices(void);
 void duplicate_swap_pages(pid_t old_pid, pid_t new_pid);
+/* a page of pid just swapped out is also the page of sharer at the same address */
+void swap_share(pid_t pid, pid_t sharer, vaddr_t page);
 
 #endif
 
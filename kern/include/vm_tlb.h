@@ -8,6 +8,30 @@ int tlb_get_rr_victim(void);
 void as_activate(void);
 /* give fault address get the segment in which it is */
 int address_segment(vaddr_t faultaddress, struct addrspace *as);
+/* remove the translation of vaddr from the TLB of this cpu, if present */
+void tlb_invalidate_vaddr(vaddr_t vaddr);
+/* same, for a page of another process */
+void tlb_invalidate_pid(pid_t pid, vaddr_t vaddr);
+/* same, only if it is in the TLB of this cpu: can be called holding spinlocks */
+void tlb_invalidate_pid_local(pid_t pid, vaddr_t vaddr);
+/* number of TLB misses served by the UTLB refill handler */
+long utlb_refill_count(void);
+/* give the address space an ASID (if needed) and make it the current one */
+void tlb_activate(struct addrspace *as);
+/* allocate the frame of zeros shared by the pages only read so far */
+void zero_page_bootstrap(void);
+
+/*
+ * Fault-around: pages handled at each fault, the faulting one included.
+ * A fault on the ELF file reads up to this many following pages of the same
+ * segment, and any fault maps the resident pages of the aligned window
+ * around the faulting one. It can be changed from the menu, up to
+ * FAULTAROUND_MAX; 1 disables it.
+ */
+#define FAULTAROUND_PAGES 4
+#define FAULTAROUND_MAX 8
+int faultaround_set_window(int pages);
+void faultaround_print_window(void);
 
 
 
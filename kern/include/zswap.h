@@ -0,0 +1,32 @@
+#ifndef _ZSWAP_H
+#define _ZSWAP_H
+
+#include <types.h>
+
+/*
+ * Compressed swap tier, in front of the swap devices. Swapped out pages are
+ * compressed with an LZ77 codec (LZ4-like format) into a pool of
+ * ZSWAP_POOL_PAGES kernel frames, filled as a ring: when it is full, the
+ * oldest pages are written back to their slot on the swap device, that is
+ * reserved for each page anyway. Pages are identified by their slot.
+ */
+#define ZSWAP_POOL_PAGES 8
+/* pages that do not compress to this size are written to the swap device */
+#define ZSWAP_MAX_SIZE (PAGE_SIZE * 3 / 4)
+/* pages compressed at the same time */
+#define ZSWAP_BUFFERS 2
+
+void zswap_init(int nslots);
+/*
+ * Store the page in paddr as the content of slot. Return 1 if it does not
+ * compress well: the caller writes it to the swap device.
+ */
+int zswap_store(int slot, paddr_t paddr);
+/* read slot into paddr, if it is in the pool. Return 1 if it is not */
+int zswap_load(int slot, paddr_t paddr);
+int zswap_present(int slot);
+/* slot is free: forget its content */
+void zswap_drop(int slot);
+void print_zswap_statistics(void);
+
+#endif
@@ -52,6 +52,8 @@
 #include "autoconf.h"  // for pseudoconfig
 #include "opt-paging.h"
 #include "swapfile.h"
+#include "pageout.h"
+#include "coremap.h"
 #include <addrspace.h>
 
 
@@ -140,6 +142,10 @@ boot(void)
 	/* init swapfile */
 	#if OPT_PAGING
 	init_swapfile();
+	/* start the pageout daemon, it needs the swapfile */
+	pageout_bootstrap();
+	/* and the thread zero-filling free frames */
+	pagezero_bootstrap();
 	#endif
 
 
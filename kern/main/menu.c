@@ -48,6 +48,8 @@
 #include "opt-paging.h"
 #include "opt-waitpid.h"
 #include <instrumentation.h>
+#include <pageout.h>
+#include <vm_tlb.h>
 #include <current.h>
 #include <syscall.h>
 /*
@@ -522,6 +524,62 @@ cmd_kheapdump(int nargs, char **args)
 	return 0;
 }
 
+#if OPT_PAGING
+/*
+ * Command for showing or setting the pageout daemon watermarks.
+ */
+static int
+cmd_pageout(int nargs, char **args)
+{
+	int result;
+
+	if (nargs == 3)
+	{
+		result = pageout_set_watermarks(atoi(args[1]), atoi(args[2]));
+		if (result)
+		{
+			kprintf("pgwm: low must be >= 0 and <= high\n");
+			return result;
+		}
+	}
+	else if (nargs != 1)
+	{
+		kprintf("Usage: pgwm [low high]\n");
+		return EINVAL;
+	}
+	pageout_print_watermarks();
+
+	return 0;
+}
+
+/*
+ * Command for showing or setting the fault-around window.
+ */
+static int
+cmd_faultaround(int nargs, char **args)
+{
+	int result;
+
+	if (nargs == 2)
+	{
+		result = faultaround_set_window(atoi(args[1]));
+		if (result)
+		{
+			kprintf("fawin: pages must be >= 1 and <= %d\n", FAULTAROUND_MAX);
+			return result;
+		}
+	}
+	else if (nargs != 1)
+	{
+		kprintf("Usage: fawin [pages]\n");
+		return EINVAL;
+	}
+	faultaround_print_window();
+
+	return 0;
+}
+#endif
+
 ////////////////////////////////////////
 //
 // Menus.
@@ -627,6 +685,10 @@ static const char *mainmenu[] = {
 	"[kh] Kernel heap stats              ",
 	"[khgen] Next kernel heap generation ",
 	"[khdump] Dump kernel heap           ",
+#if OPT_PAGING
+	"[pgwm] Pageout watermarks [low high]",
+	"[fawin] Fault-around window [pages] ",
+#endif
 	"[q] Quit and shut down              ",
 	NULL};
 
@@ -677,6 +739,10 @@ static struct
 	{"kh", cmd_kheapstats},
 	{"khgen", cmd_kheapgeneration},
 	{"khdump", cmd_kheapdump},
+#if OPT_PAGING
+	{"pgwm", cmd_pageout},
+	{"fawin", cmd_faultaround},
+#endif
 
 	/* base system tests */
 	{"at", arraytest},
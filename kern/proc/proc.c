@@ -57,7 +57,6 @@
 
 #if OPT_WAITPID
 
-#define MAX_PROC 100
 static struct _processTable
 {
 	int active;						 /* initial value 0 */
@@ -146,11 +145,16 @@ proc_init_waitpid(struct proc *proc, const char *name)
 
 #if OPT_PAGING
 
+/* the victim of a page replacement can belong to any process */
 struct addrspace *pid_getas(pid_t pid)
 {
-	KASSERT( pid == curproc->p_pid);
+	struct proc *p;
 	KASSERT(pid > 0 && pid < MAX_PROC + 1);
-	return processTable.proc[pid]->p_addrspace;
+	spinlock_acquire(&processTable.lk);
+	p = processTable.proc[pid];
+	spinlock_release(&processTable.lk);
+	KASSERT(p != NULL);
+	return p->p_addrspace;
 }
 
 #endif
@@ -189,10 +193,6 @@ proc_create(const char *name)
 	proc->finish = 0;
 	#endif
 
-	#if OPT_PAGING
-	proc->last_victim=-1;
-	#endif
-
 	proc_init_waitpid(proc, name);
 
 #if OPT_PAGING
@@ -484,7 +484,8 @@ proc_search_pid(pid_t pid)
 	spinlock_acquire(&processTable.lk);
 	p = processTable.proc[pid];
 	spinlock_release(&processTable.lk);
-	KASSERT(p->p_pid == pid);
+	/* NULL if there is no process with that pid */
+	KASSERT(p == NULL || p->p_pid == pid);
 	return p;
 #else
 	(void)pid;
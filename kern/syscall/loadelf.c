@@ -213,6 +213,17 @@ int load_elf(struct vnode *v, vaddr_t *entrypoint)
 	/* save eh in proc struct */
 	#if OPT_PAGING
 	curproc->p_eh = eh;
+
+	/*
+	 * Keep a copy of the program headers in the address space, so that
+	 * load_pages() does not need to read them again at every fault.
+	 */
+	as->as_ph = kmalloc(eh.e_phnum * sizeof(Elf_Phdr));
+	if (as->as_ph == NULL)
+	{
+		return ENOMEM;
+	}
+	as->as_phnum = eh.e_phnum;
 	#endif
 
 	/*
@@ -248,6 +259,10 @@ int load_elf(struct vnode *v, vaddr_t *entrypoint)
 			return ENOEXEC;
 		}
 
+#if OPT_PAGING
+		as->as_ph[i] = ph;
+#endif
+
 		switch (ph.p_type)
 		{
 		case PT_NULL: /* skip */
@@ -275,7 +290,14 @@ int load_elf(struct vnode *v, vaddr_t *entrypoint)
 		}
 	}
 
-#if !OPT_PAGING
+#if OPT_PAGING
+	/*
+	 * Pages are loaded on demand: hold a reference to the executable
+	 * for the whole life of the address space (dropped in as_destroy).
+	 */
+	VOP_INCREF(v);
+	as->as_vnode = v;
+#else
 
 	result = as_prepare_load(as);
 	if (result)
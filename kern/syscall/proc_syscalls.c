@@ -57,7 +57,7 @@ void sys__exit(int status)
 
   #if PRINT_TABLES
   print_ipt();
-  print_freeRamFrames();
+  print_free_frames();
   hash_print();
   print_swap();
 #endif
@@ -39,11 +39,14 @@
 #include <spinlock.h>
 #include <current.h>
 #include <mips/tlb.h>
+#include <vm_tlb.h>
 #include <pt.h>
 #include <coremap.h>
 #include <swapfile.h>
 #include <instrumentation.h>
-#include <st.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <membar.h>
 
 /*
  * Note! If OPT_DUMBVM is set, as is the case until you start the VM
@@ -52,16 +55,15 @@
  */
 
 static int nRamFrames = 0;
-static int allocTableActive = 0;
-static struct spinlock freemem_lock = SPINLOCK_INITIALIZER;
+/*
+ * Set once by vm_bootstrap(), before the other cpus are started, and never
+ * cleared: it is read at every allocation without taking a lock.
+ */
+static volatile int allocTableActive = 0;
 
 int isTableActive()
 {
-  int active;
-  spinlock_acquire(&freemem_lock);
-  active = allocTableActive;
-  spinlock_release(&freemem_lock);
-  return active;
+  return allocTableActive;
 }
 
 void vm_bootstrap(void)
@@ -76,28 +78,22 @@ void vm_bootstrap(void)
   /* alloc inverted page table */
   if (create_ipt() == -1)
     return;
-  /* alloc freeRamFrame and allocSize */
-  result = init_freeRamFrames(nRamFrames);
+  /* alloc the coremap of the buddy allocator */
+  result = init_coremap(nRamFrames);
   if (result)
   {
     return;
   }
-  result = init_allocSize(nRamFrames);
-  if (result)
-  {
-    /* reset to disable this vm management */
-    destroy_freeRamFrames();
-    return;
-  }
-  spinlock_acquire(&freemem_lock);
+  /* the coremap and the IPT are visible before the flag that lets them be used */
+  membar_store_store();
   allocTableActive = 1;
-  spinlock_release(&freemem_lock);
   /*allocation and deallocation of all ram to avoid using ram_stealmem*/
   firstpaddr = ram_getfirstfreeafterbootstrap(); /* get address of first free page */
   occupiedpages = ((int)firstpaddr) / PAGE_SIZE; /* calculate occupied pages by kernel */
   freepages = nRamFrames - occupiedpages;        /* calculate free pages remaining*/
   addr = alloc_kpages(freepages);                /*allocate all pages available*/
   free_kpages(addr);                             /* deallocate all pages previously allocated */
+  zero_page_bootstrap();
   init_instrumentation();
 }
 
@@ -120,7 +116,7 @@ vaddr_t alloc_kpages(unsigned npages)
   unsigned i;
 
   vm_can_sleep();
-  pa = getppages(npages, 1);
+  pa = getppages(npages, 1, ALLOC_ZERO);
   if (pa == 0)
   {
     return 0;
@@ -161,6 +157,13 @@ struct addrspace *as_create(void)
 
   as->as_vbase1 = 0;
   as->as_vbase2 = 0;
+  as->as_vnode = NULL;
+  as->as_ph = NULL;
+  as->as_phnum = 0;
+  /* no ASID yet: one is given at the first as_activate() */
+  as->as_asid = 0;
+  as->as_asid_gen = 0;
+  as->as_asid_cpu = NULL;
 
   return as;
 }
@@ -168,8 +171,7 @@ struct addrspace *as_create(void)
 int as_copy(struct addrspace *old, struct addrspace **ret, pid_t old_pid, pid_t new_pid)
 {
   struct addrspace *newas;
-  int i, result;
-  paddr_t paddr;
+  int result;
 
   newas = as_create();
   if (newas == NULL)
@@ -190,65 +192,70 @@ int as_copy(struct addrspace *old, struct addrspace **ret, pid_t old_pid, pid_t
   newas->as_npages1 = old->as_npages1;
   newas->as_vbase2 = old->as_vbase2;
   newas->as_npages2 = old->as_npages2;
-  
 
-  /* 
-   * Look in the IPT to see if there are pages to copy 
-   * but do not copy code pages -> they can be loaded from ELF
-   */
-
-  /* Looking for data pages */
-  for(i = 0; i < (int)newas->as_npages2; i++)
+  /* the child keeps loading its pages from the same executable */
+  newas->as_ph = kmalloc(old->as_phnum * sizeof(Elf_Phdr));
+  if (newas->as_ph == NULL)
   {
-    result = ipt_lookup(old_pid, newas->as_vbase2 + i * PAGE_SIZE);
-    if (result)
-    {
-      paddr = as_prepare_load(1);
-      memmove((void *)PADDR_TO_KVADDR(paddr),
-              (const void *)PADDR_TO_KVADDR(result),
-              PAGE_SIZE);
-      ipt_add(new_pid, paddr, newas->as_vbase2 + i * PAGE_SIZE);
-    }
+    as_destroy(newas);
+    return ENOMEM;
+  }
+  memcpy(newas->as_ph, old->as_ph, old->as_phnum * sizeof(Elf_Phdr));
+  newas->as_phnum = old->as_phnum;
+  if (old->as_vnode != NULL)
+  {
+    VOP_INCREF(old->as_vnode);
   }
+  newas->as_vnode = old->as_vnode;
 
   /* 
-   * Look for stack pages by starting by the first (bottom) page of the stack.
-   * When we do not find a page, stop searching.
+   * Look in the IPT to see if there are pages to copy 
+   * but do not copy code pages -> they can be loaded from ELF.
+   * Data and stack frames are not copied, but shared copy-on-write:
+   * both processes map them read-only until one of them writes.
    */
 
-    result = 1;
-  for (i = 0; result; i++)
+  /* only the frames of the parent are visited, not its whole address space */
+  result = ipt_share_process(old_pid, new_pid);
+  if (result == ENOMEM)
   {
-    result = ipt_lookup(old_pid, 0x7FFFF000 - i * PAGE_SIZE);
-    if (result)
-    {
-      paddr = as_prepare_load(1);
-      /* for each page to copy */
-      memmove((void *)PADDR_TO_KVADDR(paddr),
-              (const void *)PADDR_TO_KVADDR(result),
-              PAGE_SIZE);
-      ipt_add(new_pid, paddr, 0x7FFFF000 - i * PAGE_SIZE);
-    }
+    goto fail;
   }
 
-  /* Duplicate pages that are swapped out */
-
+  /*
+   * Pages that are swapped out are shared as well: the child refers to the
+   * slots of the parent. This is done last, so that a page swapped out while
+   * the frames were being shared is not missed.
+   */
   duplicate_swap_pages(old_pid, new_pid);
 
   *ret = newas;
   return 0;
+
+fail:
+  free_ipt_process(new_pid);
+  free_swap_table(new_pid);
+  as_destroy(newas);
+  return ENOMEM;
 }
 
 void as_destroy(struct addrspace *as)
 {
   KASSERT(as != NULL);
+  if (as->as_vnode != NULL)
+  {
+    vfs_close(as->as_vnode);
+  }
+  if (as->as_ph != NULL)
+  {
+    kfree(as->as_ph);
+  }
   kfree(as);
 }
 
 void as_activate(void)
 {
 
-  int i, spl;
   struct addrspace *as;
 
   as = proc_getas();
@@ -257,18 +264,8 @@ void as_activate(void)
     return;
   }
 
-  /*Disable interrupts on this CPU while frobbing the TLB. */
-  spl = splhigh();
-
-  for (i = 0; i < NUM_TLB; i++)
-  {
-    tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
-  }
-
-  splx(spl);
-
-
-  increase(TLB_INVALIDATION);
+  /* entries are tagged with the ASID: the TLB is flushed only when ASIDs are recycled */
+  tlb_activate(as);
 }
 
 void as_deactivate(void)
@@ -327,9 +324,9 @@ int as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
   return ENOSYS;
 }
 
-int as_prepare_load(unsigned npages)
+int as_prepare_load(unsigned npages, int intent)
 {
-  return getppages(npages, 0);
+  return getppages(npages, 0, intent);
 }
 
 int as_complete_load(struct addrspace *as)
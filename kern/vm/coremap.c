@@ -16,231 +16,744 @@
 #include <swapfile.h>
 #include <syscall.h>
 #include <vm_tlb.h>
-#include <st.h>
-#include <item.h>
+#include <pt.h>
+#include <pageout.h>
+#include <synch.h>
+#include <instrumentation.h>
 #include "opt-paging.h"
 
 
-static void SetBit(int *A, int k)
+static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
+static struct spinlock freemem_lock = SPINLOCK_INITIALIZER;
+static int nRamFrames = 0;
+
+/*
+ * Binary buddy allocator. Free frames are grouped in aligned blocks of
+ * 2^order frames, each on the free list of its order; a block is merged
+ * with its buddy (the block it was split from) as soon as both are free.
+ * Everything below is protected by freemem_lock.
+ */
+static struct coremap_entry *coremap = NULL;
+static int free_lists[BUDDY_MAX_ORDER + 1];
+/* number of free frames, pre-zeroed ones included */
+static int nFreeFrames = 0;
+/*
+ * free frames already zero-filled by the pagezero thread: they are kept
+ * out of the buddy lists, on a list of their own
+ */
+static int zero_list = -1;
+static int nZeroFrames = 0;
+static struct semaphore *pagezero_sem = NULL;
+static int pagezero_sleeping = 0;
+
+/*
+ * Per-cpu magazines of free frames (see MAGAZINE_SIZE). The frames in a
+ * magazine are out of the buddy lists and are not counted in nFreeFrames;
+ * they look allocated to the buddy allocator, so they are not merged.
+ * Each magazine has its own lock, taken by other cpus only to flush it, and
+ * always before freemem_lock.
+ */
+#define MAGAZINE_MAXCPUS 32
+
+struct frame_magazine
 {
+    struct spinlock lock;
+    int n;
+    int frames[MAGAZINE_SIZE];
+};
 
-    A[k / 32] |= 1 << (k % 32); // Set the bit at the k-th position in A[i]
+static struct frame_magazine magazines[MAGAZINE_MAXCPUS];
+
+static void free_list_insert(int i, int order)
+{
+    coremap[i].state = CM_FREE;
+    coremap[i].order = order;
+    coremap[i].prev = -1;
+    coremap[i].next = free_lists[order];
+    if (free_lists[order] != -1)
+    {
+        coremap[free_lists[order]].prev = i;
+    }
+    free_lists[order] = i;
 }
 
-static void ClearBit(int *A, int k)
+static void free_list_remove(int i)
 {
+    int order = coremap[i].order;
 
-    A[k / 32] &= ~(1 << (k % 32));
+    KASSERT(coremap[i].state == CM_FREE);
+    if (coremap[i].prev != -1)
+    {
+        coremap[coremap[i].prev].next = coremap[i].next;
+    }
+    else
+    {
+        free_lists[order] = coremap[i].next;
+    }
+    if (coremap[i].next != -1)
+    {
+        coremap[coremap[i].next].prev = coremap[i].prev;
+    }
+    coremap[i].state = CM_USED;
 }
 
-static int TestBit(int *A, int k)
+/* free the block of 2^order frames starting at i, merging it with its buddies */
+static void buddy_free_block(int i, int order)
 {
-    if ((A[k / 32] & (1 << (k % 32))) != 0)
-        return 1;
-    else
-        return 0;
+    int buddy;
+
+    while (order < BUDDY_MAX_ORDER)
+    {
+        buddy = i ^ (1 << order);
+        if (buddy + (1 << order) > nRamFrames || coremap[buddy].state != CM_FREE || coremap[buddy].order != order)
+        {
+            break;
+        }
+        free_list_remove(buddy);
+        /* the higher half is not the first frame of a block anymore */
+        coremap[i > buddy ? i : buddy].state = CM_USED;
+        i = i < buddy ? i : buddy;
+        order++;
+    }
+    free_list_insert(i, order);
 }
 
-static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
-static struct spinlock freemem_lock = SPINLOCK_INITIALIZER;
-static int nRamFrames = 0;
-static int *freeRamFrames = NULL;
-static unsigned long *allocSize = NULL;
+/* free n frames starting at i, as the largest aligned blocks they contain */
+static void buddy_free_range(int i, int n)
+{
+    int order;
 
-void print_freeRamFrames(void)
+    while (n > 0)
+    {
+        for (order = BUDDY_MAX_ORDER; order > 0; order--)
+        {
+            if ((i & ((1 << order) - 1)) == 0 && (1 << order) <= n)
+            {
+                break;
+            }
+        }
+        buddy_free_block(i, order);
+        i += 1 << order;
+        n -= 1 << order;
+    }
+}
+
+/*
+ * Take a block of 2^order frames, splitting a larger one if needed.
+ * Returns its first frame, -1 if there is none.
+ */
+static int buddy_alloc_block(int order)
 {
-    int i;
-    kprintf("Frame Status\n");
+    int i, k;
 
-    for (i = 0; i < nRamFrames; i++)
+    for (k = order; k <= BUDDY_MAX_ORDER && free_lists[k] == -1; k++);
+    if (k > BUDDY_MAX_ORDER)
     {
-        kprintf("  %d    %d\n", i, TestBit(freeRamFrames, i));
+        return -1;
     }
+    i = free_lists[k];
+    free_list_remove(i);
+    /* give back the upper halves */
+    while (k > order)
+    {
+        k--;
+        free_list_insert(i + (1 << k), k);
+    }
+
+    return i;
 }
 
-int init_freeRamFrames(int ramFrames)
+/* give the pre-zeroed frames back to the buddy lists, to merge them */
+static void zero_list_flush(void)
 {
     int i;
-    nRamFrames = ramFrames;
-    freeRamFrames = kmalloc(sizeof(int) * (nRamFrames/sizeof(int)+1));
-    if (freeRamFrames == NULL)
-        return 1;
 
-    for (i = 0; i < nRamFrames; i++)
+    while (zero_list != -1)
     {
-        ClearBit(freeRamFrames, i);
+        i = zero_list;
+        zero_list = coremap[i].next;
+        buddy_free_block(i, 0);
     }
+    nZeroFrames = 0;
+}
 
-    return 0;
+static struct frame_magazine *cur_magazine(void)
+{
+    KASSERT(curcpu->c_number < MAGAZINE_MAXCPUS);
+    return &magazines[curcpu->c_number];
+}
+
+/* give back the last n frames of the magazine to the buddy lists. Called with both locks held */
+static void magazine_drain(struct frame_magazine *m, int n)
+{
+    while (n-- > 0)
+    {
+        m->n--;
+        buddy_free_block(m->frames[m->n], 0);
+        nFreeFrames++;
+    }
+}
+
+/* pop a frame from the magazine of this cpu, refilling it first if empty. -1 if none */
+static long magazine_get(void)
+{
+    struct frame_magazine *m = cur_magazine();
+    long i, found = -1;
+
+    spinlock_acquire(&m->lock);
+    if (m->n == 0)
+    {
+        spinlock_acquire(&freemem_lock);
+        while (m->n < MAGAZINE_BATCH && (i = buddy_alloc_block(0)) != -1)
+        {
+            m->frames[m->n++] = i;
+            nFreeFrames--;
+        }
+        spinlock_release(&freemem_lock);
+    }
+    if (m->n > 0)
+    {
+        found = m->frames[--m->n];
+    }
+    spinlock_release(&m->lock);
+
+    return found;
 }
 
-void destroy_freeRamFrames(void)
+/* cache a frame just freed in the magazine of this cpu: if it is full, part of it goes back first */
+static void magazine_put(long i)
 {
-    freeRamFrames = NULL;
+    struct frame_magazine *m = cur_magazine();
+
+    spinlock_acquire(&m->lock);
+    if (m->n == MAGAZINE_SIZE)
+    {
+        spinlock_acquire(&freemem_lock);
+        magazine_drain(m, MAGAZINE_BATCH);
+        spinlock_release(&freemem_lock);
+    }
+    m->frames[m->n++] = i;
+    spinlock_release(&m->lock);
 }
 
-int init_allocSize(int ramFrames)
+/*
+ * Give all the frames cached by the cpus back to the buddy lists, when they
+ * are the only free frames left or they keep buddies apart. Must not hold
+ * freemem_lock.
+ */
+static void magazines_flush(void)
 {
-    /* dimension of freeRamFrames and allocSize must be equal */
+    struct frame_magazine *m;
+    int cpu;
+
+    for (cpu = 0; cpu < MAGAZINE_MAXCPUS; cpu++)
+    {
+        m = &magazines[cpu];
+        spinlock_acquire(&m->lock);
+        if (m->n > 0)
+        {
+            spinlock_acquire(&freemem_lock);
+            magazine_drain(m, m->n);
+            spinlock_release(&freemem_lock);
+        }
+        spinlock_release(&m->lock);
+    }
+}
 
-    KASSERT(ramFrames == nRamFrames);
+/* frames cached by the cpus, read without locks */
+static int magazines_count(void)
+{
+    int cpu, n = 0;
+
+    for (cpu = 0; cpu < MAGAZINE_MAXCPUS; cpu++)
+    {
+        n += magazines[cpu].n;
+    }
+
+    return n;
+}
+
+void print_free_frames(void)
+{
+    int order, i, n, cached;
+
+    cached = magazines_count();
+    spinlock_acquire(&freemem_lock);
+    kprintf("Free frames: %d (%d zeroed, %d cached by the cpus)\n", nFreeFrames + cached, nZeroFrames, cached);
+    for (order = 0; order <= BUDDY_MAX_ORDER; order++)
+    {
+        for (i = free_lists[order], n = 0; i != -1; i = coremap[i].next)
+        {
+            n++;
+        }
+        kprintf("  order %2d: %d blocks\n", order, n);
+    }
+    spinlock_release(&freemem_lock);
+}
+
+int init_coremap(int ramFrames)
+{
     int i;
-    allocSize = kmalloc(sizeof(unsigned long) * nRamFrames);
-    if (allocSize == NULL)
+
+    nRamFrames = ramFrames;
+    coremap = kmalloc(sizeof(struct coremap_entry) * nRamFrames);
+    if (coremap == NULL)
         return 1;
 
+    /* frames become free when they are given back by vm_bootstrap() */
     for (i = 0; i < nRamFrames; i++)
     {
-        allocSize[i] = 0;
+        coremap[i].state = CM_USED;
+        coremap[i].order = 0;
+        coremap[i].npages = 0;
+        coremap[i].next = coremap[i].prev = -1;
+    }
+    for (i = 0; i <= BUDDY_MAX_ORDER; i++)
+    {
+        free_lists[i] = -1;
+    }
+    for (i = 0; i < MAGAZINE_MAXCPUS; i++)
+    {
+        spinlock_init(&magazines[i].lock);
+        magazines[i].n = 0;
     }
 
     return 0;
 }
 
 static paddr_t
-getfreeppages(unsigned long npages)
+getfreeppages(unsigned long npages, int intent, int *zeroed)
 {
-    paddr_t addr;
-    long i, first, found, np = (long)npages;
-    int result;
+    long found, np = (long)npages;
+    int order, flushed = 0;
 
+    *zeroed = 0;
     if (!isTableActive())
         return 0;
-    spinlock_acquire(&freemem_lock);
+    for (order = 0; (1L << order) < np; order++);
+    if (order > BUDDY_MAX_ORDER)
+        return 0;
 
-    for (i = 0, first = found = -1; i < nRamFrames; i++)
+    /*
+     * single frames come from the magazine of this cpu, but for zero-fill
+     * allocations while there are pre-zeroed frames (a hint: nZeroFrames is
+     * read without the lock)
+     */
+    if (np == 1 && !(intent == ALLOC_ZERO && nZeroFrames > 0))
     {
-        result = TestBit(freeRamFrames, i);
-        if (result)
+        found = magazine_get();
+        if (found != -1)
         {
-            result = TestBit(freeRamFrames, i - 1);
-            if (i == 0 || !result)
-                first = i; /* set first free in an interval */
-            if (i - first + 1 >= np)
-            {
-                found = first;
-                break;
-            }
+            coremap[found].npages = 1;
+            return (paddr_t)found * PAGE_SIZE;
         }
     }
 
-    if (found >= 0)
+retry:
+    spinlock_acquire(&freemem_lock);
+
+    found = -1;
+    /* a zero-fill allocation is just a pop from the pool */
+    if (np == 1 && intent == ALLOC_ZERO && zero_list != -1)
+    {
+        found = zero_list;
+        *zeroed = 1;
+    }
+    if (found == -1)
     {
-        for (i = found; i < found + np; i++)
+        found = buddy_alloc_block(order);
+    }
+    if (found == -1 && zero_list != -1)
+    {
+        if (np == 1)
         {
-            ClearBit(freeRamFrames, i);
+            /* only pre-zeroed frames are left */
+            found = zero_list;
+            *zeroed = intent == ALLOC_ZERO;
+        }
+        else
+        {
+            /* zeroed frames may be what keeps buddies apart */
+            zero_list_flush();
+            found = buddy_alloc_block(order);
         }
-        allocSize[found] = np;
-        addr = (paddr_t)found * PAGE_SIZE;
     }
-    else
+    if (found != -1 && found == zero_list)
     {
-        addr = 0;
+        zero_list = coremap[found].next;
+        coremap[found].state = CM_USED;
+        nZeroFrames--;
+    }
+
+    if (found != -1)
+    {
+        /* the block is rounded up to a power of two: the tail is not needed */
+        buddy_free_range(found + np, (1 << order) - np);
+        coremap[found].npages = np;
+        nFreeFrames -= np;
     }
 
     spinlock_release(&freemem_lock);
 
-    return addr;
+    /* the frames left may be in the magazines, or be kept apart by them */
+    if (found == -1 && !flushed && magazines_count() > 0)
+    {
+        flushed = 1;
+        magazines_flush();
+        goto retry;
+    }
+
+    return found == -1 ? 0 : (paddr_t)found * PAGE_SIZE;
 }
 
+static void pagezero_wakeup(void);
+
 static void
 as_zero_region(paddr_t paddr, unsigned npages)
 {
     bzero((void *)PADDR_TO_KVADDR(paddr), npages * PAGE_SIZE);
 }
 
-paddr_t
-getppages(unsigned long npages, int kmem)
+/*
+ * Evict up to max user frames with the global CLOCK. Dirty victims are
+ * written to the swapfile in clusters, with as few I/O operations as
+ * possible; a frame shared copy-on-write is written once and its slot is
+ * shared by all the processes mapping it. On return the victims are unmapped and owned by the caller
+ * (pid -2). Returns the number of frames evicted, 0 if none.
+ */
+int evict_pages(paddr_t *victims, int max)
 {
     paddr_t paddr;
     vaddr_t vaddr;
-    pid_t pid_victim;
+    pid_t pid_victim, sharer;
     struct addrspace *as_victim;
-    int victim_segment, result;
+    int victim_segment, result, i;
+    /* victims are written to the swapfile in clusters */
+    struct swap_page cluster[SWAP_CLUSTER];
+    int nvictims, npages_out;
+    /* the victim written in each position of the cluster */
+    int written[SWAP_CLUSTER];
+
+    KASSERT(max > 0 && max <= SWAP_CLUSTER);
+    /*
+     * get physical and virtual address of victim. No spinlock can be held:
+     * removing the victim from the TLB of another cpu means waiting for it
+     */
+    pid_victim = 0;
+    paddr = get_victim(&vaddr, &pid_victim);
+    if (paddr == 0)
+    {
+        return 0;
+    }
+    victims[0] = paddr;
+    nvictims = 1;
+    npages_out = 0;
+    for (;;)
+    {
+        /* get address space of the process whose page is the victim */
+        as_victim = pid_getas(pid_victim);
+        /*
+         * get in which segment the page is. The owner may be a child still
+         * being forked, that has no address space yet: it can only own
+         * frames it shares with its parent, that are data or stack pages
+         */
+        victim_segment = as_victim != NULL ? address_segment(vaddr, as_victim) : 2;
+        /*
+         * text pages are not written, they are loaded again from the ELF;
+         * clean pages are not written either, they are read again from their
+         * slot in the swapfile or, if they have none, from the ELF
+         */
+        if (victim_segment != 1 && ipt_is_clean(paddr))
+        {
+            increase(SWAP_CLEAN_DROP);
+        }
+        else if (victim_segment != 1)
+        {
+            /* a frame shared copy-on-write is written once, for its owner */
+            cluster[npages_out].paddr = paddr;
+            cluster[npages_out].vaddr = vaddr;
+            cluster[npages_out].pid = pid_victim;
+            written[npages_out] = nvictims - 1;
+            npages_out++;
+        }
+        /*
+         * a write is needed anyway: pick more victims and write them all
+         * with a single I/O operation
+         */
+        if (npages_out == 0 || npages_out == SWAP_CLUSTER || nvictims == max)
+        {
+            break;
+        }
+        paddr = get_victim(&vaddr, &pid_victim);
+        if (paddr == 0)
+        {
+            break;
+        }
+        victims[nvictims++] = paddr;
+    }
+    /* swap pages out */
+    if (npages_out > 0)
+    {
+        result = swap_out_cluster(cluster, npages_out);
+        if (result)
+        {
+            panic("Cannot write to the swapfile\n");
+        }
+    }
+    /* the other processes sharing a frame refer to the same slot */
+    for (i = 0; i < npages_out; i++)
+    {
+        for (sharer = ipt_next_sharer(victims[written[i]], 0); sharer != -1; sharer = ipt_next_sharer(victims[written[i]], sharer))
+        {
+            if (sharer != cluster[i].pid)
+            {
+                swap_share(cluster[i].pid, sharer, cluster[i].vaddr);
+            }
+        }
+    }
+    for (i = 0; i < nvictims; i++)
+    {
+        ipt_release_victim(victims[i]);
+    }
+
+    return nvictims;
+}
+
+/* give back to the free frames a victim not used by the caller */
+void release_evicted_page(paddr_t paddr)
+{
+    ipt_kadd(-1, paddr, 0);
+    freeppages(paddr, paddr / PAGE_SIZE);
+}
+
+paddr_t
+getppages(unsigned long npages, int kmem, int intent)
+{
+    paddr_t paddr;
+    paddr_t victims[SWAP_CLUSTER];
+    int nvictims, i, zeroed;
 
     /* try freed pages first */
-    paddr = getfreeppages(npages);
+    paddr = getfreeppages(npages, intent, &zeroed);
     if (paddr == 0)
     {
         /* call stealmem */
         spinlock_acquire(&stealmem_lock);
         paddr = ram_stealmem(npages);
         spinlock_release(&stealmem_lock);
+
+        /* save length allocated by ram_stealmem, the buddy allocator already did */
+        if (paddr != 0 && isTableActive())
+        {
+            spinlock_acquire(&freemem_lock);
+            coremap[paddr / PAGE_SIZE].npages = npages;
+            spinlock_release(&freemem_lock);
+        }
     }
 
-    /* save length allocated */
-    if (paddr != 0 && isTableActive())
+    /* running short of free frames: let the pageout daemon refill them */
+    if (isTableActive() && count_free_frames() < pageout_low_watermark())
     {
-        spinlock_acquire(&freemem_lock);
-        allocSize[paddr / PAGE_SIZE] = npages;
-        spinlock_release(&freemem_lock);
+        pageout_wakeup();
     }
 
     /* If neither getfreeppages and ram_stealmem do no return pages, swap out a page */
     if (paddr == 0 && isTableActive())
     {
-        spinlock_acquire(&freemem_lock);
         /* we can only get one page at a time with swapping, otherwise in case of swap problems occur */
         if (!kmem)
         {
             KASSERT(npages == 1);
-            pid_victim = 0;
-        }
-        else
-        {
-            pid_victim = 1;
         }
         /* cannot swap contiguous pages, so in case of kernel, panic */
-        if (paddr == 0 && kmem && npages != 1)
+        if (kmem && npages != 1)
         {
             panic("No contiguous %ld free ram frames for kernel allocation", npages);
         }
-        /* get physical and virtual address of victim */
+        /*
+         * the daemon did not keep up: evict synchronously. Only the first
+         * victim is returned, the others become free frames
+         */
+        nvictims = 0;
         if (!kmem)
         {
-            paddr = get_victim(&vaddr, &pid_victim);
+            nvictims = evict_pages(victims, SWAP_CLUSTER);
         }
         /* no victim found */
-        if (paddr == 0)
+        if (nvictims == 0)
         {
             panic("It was not possible to find a page victim.\nAre you allocating more kernel memory than the available ram size?");
         }
-        /* get address space of the process whose page is the victim */
-        as_victim = pid_getas(pid_victim);
-        /* get in which segment the page is */
-        victim_segment = address_segment(vaddr, as_victim);
-        spinlock_release(&freemem_lock);
-        /* swap page out */
-        result = swap_out(paddr, vaddr, victim_segment, pid_victim);
-        if (result)
+        for (i = 1; i < nvictims; i++)
         {
-            return 0;
+            release_evicted_page(victims[i]);
         }
+        paddr = victims[0];
     }
 
     KASSERT(paddr != 0);
-    /* zero fill the allocated page(s) */
-    as_zero_region(paddr, npages);
+    if (zeroed)
+    {
+        increase(PREZEROED_USED);
+    }
+    else if (intent == ALLOC_ZERO)
+    {
+        /* zero fill the allocated page(s) */
+        as_zero_region(paddr, npages);
+    }
+    /* the pool of zeroed frames is running low */
+    if (isTableActive() && (zeroed || intent == ALLOC_ZERO))
+    {
+        pagezero_wakeup();
+    }
 
     return paddr;
 }
 
+int count_free_frames(void)
+{
+    return nFreeFrames + magazines_count();
+}
+
+paddr_t getfreeppage(void)
+{
+    int zeroed;
+
+    return getfreeppages(1, ALLOC_OVERWRITE, &zeroed);
+}
+
+/*
+ * wake up the pagezero thread if there are free frames to zero and the
+ * pool is not full. Must not hold spinlocks.
+ * The thread being awake is checked first without the lock: if it is just
+ * going to sleep, the next allocation wakes it up.
+ */
+static void pagezero_wakeup(void)
+{
+    int wake;
+
+    if (pagezero_sem == NULL || !pagezero_sleeping)
+    {
+        return;
+    }
+    spinlock_acquire(&freemem_lock);
+    wake = pagezero_sleeping && nZeroFrames < PAGEZERO_POOL && nZeroFrames < nFreeFrames;
+    if (wake)
+    {
+        pagezero_sleeping = 0;
+    }
+    spinlock_release(&freemem_lock);
+    if (wake)
+    {
+        V(pagezero_sem);
+    }
+}
+
+/*
+ * Take a free frame that is not zero-filled yet, if the pool is not full.
+ * The frame is in use while it is zeroed, so that no one gets it half
+ * done; if there is none, the thread is marked as sleeping.
+ */
+static long pagezero_get_frame(void)
+{
+    long i;
+
+    spinlock_acquire(&freemem_lock);
+    i = -1;
+    if (nZeroFrames < PAGEZERO_POOL)
+    {
+        i = buddy_alloc_block(0);
+    }
+    if (i >= 0)
+    {
+        nFreeFrames--;
+    }
+    else
+    {
+        pagezero_sleeping = 1;
+    }
+    spinlock_release(&freemem_lock);
+
+    return i;
+}
+
+/*
+ * Keeps a pool of zero-filled free frames, so that zero-fill faults do not
+ * have to bzero the frame they get. A frame at a time, giving the cpu back
+ * after each one: the work is done when there is nothing better to do.
+ */
+static void pagezero_thread(void *data1, unsigned long data2)
+{
+    long i;
+
+    (void)data1;
+    (void)data2;
+
+    for (;;)
+    {
+        i = pagezero_get_frame();
+        if (i < 0)
+        {
+            P(pagezero_sem);
+            continue;
+        }
+        as_zero_region((paddr_t)i * PAGE_SIZE, 1);
+        spinlock_acquire(&freemem_lock);
+        coremap[i].state = CM_ZEROED;
+        coremap[i].next = zero_list;
+        zero_list = i;
+        nFreeFrames++;
+        nZeroFrames++;
+        spinlock_release(&freemem_lock);
+        increase(PAGE_PREZEROED);
+        thread_yield();
+    }
+}
+
+void pagezero_bootstrap(void)
+{
+    int result;
+
+    if (!isTableActive())
+    {
+        return;
+    }
+    pagezero_sem = sem_create("pagezero", 0);
+    if (pagezero_sem == NULL)
+    {
+        panic("pagezero: cannot create semaphore\n");
+    }
+    result = thread_fork("pagezero", NULL, pagezero_thread, NULL, 0);
+    if (result)
+    {
+        panic("pagezero: thread_fork failed: %s\n", strerror(result));
+    }
+}
+
 int freeppages(paddr_t addr, long first_page)
 {
-    long i, first, np = (long)allocSize[first_page];
+    long first, np;
 
     if (!isTableActive())
         return 0;
     first = addr / PAGE_SIZE;
-    KASSERT(allocSize != NULL);
+    KASSERT(coremap != NULL);
     KASSERT(nRamFrames > first);
+    KASSERT(first == first_page);
 
-    spinlock_acquire(&freemem_lock);
-    for (i = first; i < first + np; i++)
+    /* the frames belong to the caller: no lock is needed to look at them */
+    np = coremap[first].npages;
+    coremap[first].npages = 0;
+    if (np == 1)
     {
-        SetBit(freeRamFrames, i);
+        magazine_put(first);
+        return 1;
     }
 
+    spinlock_acquire(&freemem_lock);
+    buddy_free_range(first, np);
+    nFreeFrames += np;
+
     spinlock_release(&freemem_lock);
 
     return (int)np;
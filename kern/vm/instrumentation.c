@@ -15,6 +15,8 @@
 #include <proc.h>
 #include <kern/errno.h>
 #include <instrumentation.h>
+#include <vm_tlb.h>
+#include <zswap.h>
 
 /* TLB Faults: The number of TLB misses that have occurred (not including faults that cause
 a program to crash). */
@@ -59,6 +61,53 @@ static long int swap_out_pages;
 
 static long int swap_in_pages;
 
+/* Copy-on-write Faults: The number of writes on pages shared with a parent or child after fork. */
+
+static long int cow_faults;
+
+/* Swapfile Write/Read Operations: The number of VOP_WRITE/VOP_READ on the swap file (a cluster of pages is moved with a single one). */
+
+static long int swap_out_ios;
+static long int swap_in_ios;
+
+/* Swapfile Read-ahead Pages: The number of pages read from the swap file together with a faulting one, without a fault. */
+
+static long int swap_readahead_pages;
+
+/* Pageout Daemon Wakeups/Pages: The number of times the pageout daemon ran and the number of frames it freed ahead of demand. */
+
+static long int pageout_wakeups;
+static long int pageout_pages;
+
+/* Frames Pre-zeroed/Pre-zeroed Frames Used: The number of free frames zero-filled by the pagezero thread and the number of allocations served with one of them. */
+
+static long int prezeroed_pages;
+static long int prezeroed_used;
+
+/* Software TLB Reloads: The number of TLB reloads served by the per-cpu software TLB, without looking at the page table. */
+
+static long int stlb_hits;
+
+/* Clean Pages Dropped: The number of victims evicted without writing them, as their copy in the swapfile was still valid. */
+
+static long int swap_clean_drops;
+
+/* Zero Page Mappings: The number of read faults on pages never written, mapped on the shared zero page. */
+
+static long int zero_page_maps;
+
+/* ELF Read-around Pages: The number of pages read from the ELF file together with the faulting one, in the same read. */
+
+static long int elf_readaround_pages;
+
+/* TLB Fault-around Entries: The number of translations of resident pages put in the TLB around a faulting address. */
+
+static long int faultaround_maps;
+
+/* Clean Page Writes: The number of first writes on clean pages, mapped read-only to catch them (not copy-on-write faults). */
+
+static long int clean_page_writes;
+
 static struct spinlock instr_lock = SPINLOCK_INITIALIZER;
 
 
@@ -75,6 +124,20 @@ void init_instrumentation(void)
     faults_with_elf_load = 0;
     swap_out_pages = 0;
     swap_in_pages = 0;
+    cow_faults = 0;
+    swap_out_ios = 0;
+    swap_in_ios = 0;
+    swap_readahead_pages = 0;
+    pageout_wakeups = 0;
+    pageout_pages = 0;
+    prezeroed_pages = 0;
+    prezeroed_used = 0;
+    stlb_hits = 0;
+    swap_clean_drops = 0;
+    zero_page_maps = 0;
+    elf_readaround_pages = 0;
+    faultaround_maps = 0;
+    clean_page_writes = 0;
 }
 
 void increase(long int indicator)
@@ -124,6 +187,62 @@ void increase(long int indicator)
         new_pages_zeroed++;
         break;
 
+    case COW_FAULT:
+        cow_faults++;
+        break;
+
+    case SWAP_OUT_IO:
+        swap_out_ios++;
+        break;
+
+    case SWAP_IN_IO:
+        swap_in_ios++;
+        break;
+
+    case SWAP_READAHEAD:
+        swap_readahead_pages++;
+        break;
+
+    case PAGEOUT_WAKEUP:
+        pageout_wakeups++;
+        break;
+
+    case PAGEOUT_PAGE:
+        pageout_pages++;
+        break;
+
+    case PAGE_PREZEROED:
+        prezeroed_pages++;
+        break;
+
+    case PREZEROED_USED:
+        prezeroed_used++;
+        break;
+
+    case STLB_HIT:
+        stlb_hits++;
+        break;
+
+    case SWAP_CLEAN_DROP:
+        swap_clean_drops++;
+        break;
+
+    case ZERO_PAGE_MAP:
+        zero_page_maps++;
+        break;
+
+    case ELF_READAROUND:
+        elf_readaround_pages++;
+        break;
+
+    case FAULT_AROUND_MAP:
+        faultaround_maps++;
+        break;
+
+    case CLEAN_PAGE_WRITE:
+        clean_page_writes++;
+        break;
+
     default:
 
         break;
@@ -159,6 +278,42 @@ void print_statistics(void)
     kprintf("Page Faults from Swapfile: %ld          \n", swap_in_pages);
     kprintf("----------------------------------------\n");
     kprintf("Swapfile Writes: %ld                    \n", swap_out_pages);
+    kprintf("----------------------------------------\n");
+    kprintf("Copy-on-write Faults: %ld               \n", cow_faults);
+    kprintf("----------------------------------------\n");
+    kprintf("Clean Page Writes: %ld                  \n", clean_page_writes);
+    kprintf("----------------------------------------\n");
+    kprintf("Swapfile Write Operations: %ld          \n", swap_out_ios);
+    kprintf("----------------------------------------\n");
+    kprintf("Swapfile Read Operations: %ld           \n", swap_in_ios);
+    kprintf("----------------------------------------\n");
+    kprintf("Swapfile Read-ahead Pages: %ld          \n", swap_readahead_pages);
+    kprintf("----------------------------------------\n");
+    kprintf("Pageout Daemon Wakeups: %ld             \n", pageout_wakeups);
+    kprintf("----------------------------------------\n");
+    kprintf("Pageout Daemon Freed Pages: %ld         \n", pageout_pages);
+    kprintf("----------------------------------------\n");
+    kprintf("Frames Pre-zeroed: %ld                  \n", prezeroed_pages);
+    kprintf("----------------------------------------\n");
+    kprintf("Pre-zeroed Frames Used: %ld             \n", prezeroed_used);
+    kprintf("----------------------------------------\n");
+    kprintf("Clean Pages Dropped: %ld                \n", swap_clean_drops);
+    kprintf("----------------------------------------\n");
+    kprintf("Zero Page Mappings: %ld                 \n", zero_page_maps);
+    kprintf("----------------------------------------\n");
+    kprintf("ELF Read-around Pages: %ld              \n", elf_readaround_pages);
+    kprintf("----------------------------------------\n");
+    /* put in free TLB slots: not counted as TLB Faults */
+    kprintf("TLB Fault-around Entries: %ld           \n", faultaround_maps);
+    kprintf("----------------------------------------\n");
+    kprintf("Software TLB Reloads: %ld               \n", stlb_hits);
+    kprintf("----------------------------------------\n");
+    /* served in exception-mips1.S, before vm_fault: not counted as TLB Faults */
+    kprintf("TLB Refills (fast path): %ld            \n", utlb_refill_count());
+    kprintf("----------------------------------------\n");
+    print_zswap_statistics();
+    kprintf("----------------------------------------\n");
+    print_swap_devices();
     kprintf("----------------------------------------\n\n");
 
     flag=1;
@@ -0,0 +1,135 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <synch.h>
+#include <thread.h>
+#include <vm.h>
+#include <addrspace.h>
+#include <coremap.h>
+#include <swapfile.h>
+#include <instrumentation.h>
+#include <pageout.h>
+
+static struct semaphore *pageout_sem = NULL;
+static struct spinlock pageout_lock = SPINLOCK_INITIALIZER;
+/* watermarks and daemon state, protected by pageout_lock */
+static int low_watermark = PAGEOUT_LOW;
+static int high_watermark = PAGEOUT_HIGH;
+static int pageout_running = 0;
+
+static void pageout_thread(void *data1, unsigned long data2)
+{
+    paddr_t victims[SWAP_CLUSTER];
+    int nvictims, i, high;
+
+    (void)data1;
+    (void)data2;
+
+    for (;;)
+    {
+        P(pageout_sem);
+        increase(PAGEOUT_WAKEUP);
+        for (;;)
+        {
+            spinlock_acquire(&pageout_lock);
+            high = high_watermark;
+            spinlock_release(&pageout_lock);
+            if (count_free_frames() >= high)
+            {
+                break;
+            }
+            nvictims = evict_pages(victims, SWAP_CLUSTER);
+            if (nvictims == 0)
+            {
+                /* nothing left to evict */
+                break;
+            }
+            for (i = 0; i < nvictims; i++)
+            {
+                release_evicted_page(victims[i]);
+                increase(PAGEOUT_PAGE);
+            }
+        }
+        spinlock_acquire(&pageout_lock);
+        pageout_running = 0;
+        spinlock_release(&pageout_lock);
+    }
+}
+
+void pageout_bootstrap(void)
+{
+    int result;
+
+    if (!isTableActive())
+    {
+        return;
+    }
+    pageout_sem = sem_create("pageout", 0);
+    if (pageout_sem == NULL)
+    {
+        panic("pageout: cannot create semaphore\n");
+    }
+    result = thread_fork("pageout", NULL, pageout_thread, NULL, 0);
+    if (result)
+    {
+        panic("pageout: thread_fork failed: %s\n", strerror(result));
+    }
+}
+
+/* called on allocation when the free frames are below the low watermark */
+void pageout_wakeup(void)
+{
+    int wake;
+
+    if (pageout_sem == NULL)
+    {
+        return;
+    }
+    /* wake the daemon only once per round of work */
+    spinlock_acquire(&pageout_lock);
+    wake = !pageout_running;
+    pageout_running = 1;
+    spinlock_release(&pageout_lock);
+    if (wake)
+    {
+        V(pageout_sem);
+    }
+}
+
+int pageout_low_watermark(void)
+{
+    int low;
+
+    spinlock_acquire(&pageout_lock);
+    low = low_watermark;
+    spinlock_release(&pageout_lock);
+
+    return low;
+}
+
+int pageout_set_watermarks(int low, int high)
+{
+    if (low < 0 || high < low)
+    {
+        return EINVAL;
+    }
+    spinlock_acquire(&pageout_lock);
+    low_watermark = low;
+    high_watermark = high;
+    spinlock_release(&pageout_lock);
+
+    return 0;
+}
+
+void pageout_print_watermarks(void)
+{
+    int low, high;
+
+    spinlock_acquire(&pageout_lock);
+    low = low_watermark;
+    high = high_watermark;
+    spinlock_release(&pageout_lock);
+    kprintf("Pageout watermarks: low %d, high %d frames (free now: %d)\n",
+            low, high, count_free_frames());
+}
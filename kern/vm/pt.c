@@ -13,17 +13,470 @@
 #include <types.h>
 #include <pt.h>
 #include <coremap.h>
-#include <st.h>
-#include <item.h>
 #include <opt-paging.h>
+#include <thread.h>
+#include <wchan.h>
 
 /* inverted page table */
 static struct ipt_entry *ipt;
 static int nRamFrames;
+/*
+ * A single lock protects the ipt, the hashes, the aliases and the lists of
+ * the processes. Most operations touch several of them at once (a mapping
+ * is in a hash chain, in the list of its process and, for a shared frame,
+ * in the aliases of the frame, and moving the ownership of a frame moves
+ * it to another bucket), so per-bucket locks would need an order among
+ * buckets, and the critical sections are short: no I/O, no copies, no
+ * sleeping. What is held for long is the busy bit of a frame (IPT_BUSY),
+ * that works as a per-frame lock: whoever finds a frame busy sleeps on
+ * ipt_wchan until a frame is unlocked.
+ */
 static struct spinlock ipt_lock = SPINLOCK_INITIALIZER;
+static struct wchan *ipt_wchan;
 static int ipt_active = 0;
 
-static ST ipt_hash = NULL;
+#if MAX_PROC > IPT_PID_KERNEL
+#error "pids do not fit in the key of ipt entries"
+#endif
+
+/*
+ * Hash of the user mappings, keyed by (pid, page number): buckets hold the
+ * first entry of their chain, -1 if empty. Chains are threaded through the
+ * entries themselves (see struct ipt_alias).
+ */
+static int *ipt_hash = NULL;
+static int nBuckets;
+static int bucket_bits;
+
+/*
+ * Records allocated on demand, in chunks of POOL_CHUNK (see pool_grow):
+ * record i is entry i % POOL_CHUNK of chunk i / POOL_CHUNK. The free ones
+ * are chained through their first word.
+ */
+#define POOL_CHUNK 64
+struct ipt_pool
+{
+    char **chunks;
+    size_t size;
+    int nchunks, maxchunks;
+    int free;
+};
+
+/* aliases of shared frames, up to IPT_SHARE_FACTOR - 1 per frame */
+static struct ipt_pool alias_pool;
+/* struct ipt_share of the shared and text frames, one per frame at most */
+static struct ipt_pool share_pool;
+
+/*
+ * Mappings of each process, in a list threaded through the frame entries
+ * and aliases (proc_next, proc_prev): exit and fork walk the frames of the
+ * process only, instead of the whole ipt.
+ */
+static int proc_frames[MAX_PROC + 1];
+
+/* CLOCK replacement: next frame to be examined */
+static int clock_hand = 0;
+
+static void *pool_at(struct ipt_pool *pool, int i)
+{
+    return pool->chunks[i / POOL_CHUNK] + (i % POOL_CHUNK) * pool->size;
+}
+
+/* a free record, -1 if none. Called with ipt_lock held */
+static int pool_get(struct ipt_pool *pool)
+{
+    int i = pool->free;
+
+    if (i != -1)
+    {
+        pool->free = *(int *)pool_at(pool, i);
+    }
+    return i;
+}
+
+static void pool_put(struct ipt_pool *pool, int i)
+{
+    *(int *)pool_at(pool, i) = pool->free;
+    pool->free = i;
+}
+
+static struct ipt_alias *alias_at(int a)
+{
+    return pool_at(&alias_pool, a);
+}
+
+/* share record of the frame at index, that must have one */
+static struct ipt_share *share_at(int index)
+{
+    KASSERT(ipt[index].share != -1);
+    return pool_at(&share_pool, ipt[index].share);
+}
+
+/* first alias of the frame at index, -1 if none */
+static int frame_alias(int index)
+{
+    return ipt[index].share == -1 ? -1 : share_at(index)->alias;
+}
+
+/* executable of a text frame, NULL for the others */
+static struct vnode *frame_vn(int index)
+{
+    return ipt[index].share == -1 ? NULL : share_at(index)->vn;
+}
+
+/* give the frame at index a share record, if it has none and there is a free one. Return ENOMEM if not */
+static int get_share(int index)
+{
+    struct ipt_share *share;
+
+    if (ipt[index].share != -1)
+    {
+        return 0;
+    }
+    ipt[index].share = pool_get(&share_pool);
+    if (ipt[index].share == -1)
+    {
+        return ENOMEM;
+    }
+    share = share_at(index);
+    share->alias = -1;
+    share->next_text = -1;
+    share->vn = NULL;
+    return 0;
+}
+
+/* give back the share record of a frame that is neither shared nor text anymore */
+static void put_share(int index)
+{
+    if (ipt[index].share != -1 && share_at(index)->alias == -1 && share_at(index)->vn == NULL)
+    {
+        pool_put(&share_pool, ipt[index].share);
+        ipt[index].share = -1;
+    }
+}
+
+/* key of page vaddr of pid, without flags */
+static uint32_t ipt_key(pid_t pid, vaddr_t vaddr)
+{
+    return (vaddr & PAGE_FRAME) | ((uint32_t)pid & IPT_PID_MASK) << IPT_PID_SHIFT;
+}
+
+static pid_t key_pid(uint32_t key)
+{
+    pid_t pid = (key >> IPT_PID_SHIFT) & IPT_PID_MASK;
+
+    /* free and kernel frames */
+    return pid >= IPT_PID_KERNEL ? pid - (IPT_PID_MASK + 1) : pid;
+}
+
+/* owner of the frame at index: -1 if free, -2 if kernel */
+static pid_t frame_pid(int index)
+{
+    return key_pid(ipt[index].key);
+}
+
+static vaddr_t frame_vaddr(int index)
+{
+    return ipt[index].key & PAGE_FRAME;
+}
+
+/* set the owner of a frame, keeping its flags */
+static void set_owner(int index, pid_t pid, vaddr_t vaddr)
+{
+    ipt[index].key = ipt_key(pid, vaddr) | (ipt[index].key & IPT_FLAGS);
+}
+
+/*
+ * Fibonacci hashing of (vpn << 7 | pid): multiplying by 2^32 / phi mixes
+ * every bit of the key into the high bits of the product, that select
+ * the bucket. Summing vaddr and pid instead made the same page of
+ * different processes fall in neighbouring buckets, and page-aligned
+ * vaddrs all share their low bits.
+ */
+static int ipt_hashfn(uint32_t key)
+{
+    return ((key >> IPT_PID_SHIFT) * 2654435769U) >> (32 - bucket_bits);
+}
+
+/* next field of an entry of a hash chain: a frame or an alias */
+static int *chain_next(int n)
+{
+    return n < nRamFrames ? &ipt[n].next : &alias_at(n - nRamFrames)->next;
+}
+
+static uint32_t chain_key(int n)
+{
+    return (n < nRamFrames ? ipt[n].key : alias_at(n - nRamFrames)->key) & ~IPT_FLAGS;
+}
+
+/* frame of a mapping */
+static int chain_frame(int n)
+{
+    return n < nRamFrames ? n : alias_at(n - nRamFrames)->frame;
+}
+
+static int *proc_next(int n)
+{
+    return n < nRamFrames ? &ipt[n].proc_next : &alias_at(n - nRamFrames)->proc_next;
+}
+
+static int *proc_prev(int n)
+{
+    return n < nRamFrames ? &ipt[n].proc_prev : &alias_at(n - nRamFrames)->proc_prev;
+}
+
+/*
+ * Add a mapping, whose key is already set, to the hash and to the list of
+ * its process. Called with ipt_lock held, as all the hash functions
+ */
+static void link_mapping(int n)
+{
+    int bucket = ipt_hashfn(chain_key(n));
+    pid_t pid = key_pid(chain_key(n));
+
+    *chain_next(n) = ipt_hash[bucket];
+    ipt_hash[bucket] = n;
+
+    *proc_next(n) = proc_frames[pid];
+    *proc_prev(n) = -1;
+    if (proc_frames[pid] != -1)
+    {
+        *proc_prev(proc_frames[pid]) = n;
+    }
+    proc_frames[pid] = n;
+}
+
+static void unlink_mapping(int n)
+{
+    int *prev = &ipt_hash[ipt_hashfn(chain_key(n))];
+
+    while (*prev != n)
+    {
+        KASSERT(*prev != -1);
+        prev = chain_next(*prev);
+    }
+    *prev = *chain_next(n);
+
+    if (*proc_prev(n) == -1)
+    {
+        proc_frames[key_pid(chain_key(n))] = *proc_next(n);
+    }
+    else
+    {
+        *proc_next(*proc_prev(n)) = *proc_next(n);
+    }
+    if (*proc_next(n) != -1)
+    {
+        *proc_prev(*proc_next(n)) = *proc_prev(n);
+    }
+}
+
+/* frame mapped at vaddr by pid, -1 if none */
+static int hash_lookup(pid_t pid, vaddr_t vaddr)
+{
+    uint32_t key = ipt_key(pid, vaddr);
+    int n;
+
+    for (n = ipt_hash[ipt_hashfn(key)]; n != -1; n = *chain_next(n))
+    {
+        if (chain_key(n) == key)
+        {
+            return chain_frame(n);
+        }
+    }
+
+    return -1;
+}
+
+/* map the frame at index also in pid. Return ENOMEM if there are no free records (see ipt_grow) */
+static int add_alias(int index, pid_t pid)
+{
+    int a;
+
+    if (alias_pool.free == -1 || get_share(index))
+    {
+        return ENOMEM;
+    }
+    a = pool_get(&alias_pool);
+
+    alias_at(a)->key = ipt_key(pid, frame_vaddr(index));
+    alias_at(a)->frame = index;
+    alias_at(a)->sibling = share_at(index)->alias;
+    share_at(index)->alias = a;
+    link_mapping(nRamFrames + a);
+
+    return 0;
+}
+
+/*
+ * Add a chunk of free records to pool. Called without ipt_lock, as it
+ * allocates. Return ENOMEM if all the chunks are there already or there is
+ * no memory.
+ */
+static int pool_grow(struct ipt_pool *pool)
+{
+    char *chunk;
+    int i;
+
+    chunk = kmalloc(pool->size * POOL_CHUNK);
+    if (chunk == NULL)
+    {
+        return ENOMEM;
+    }
+
+    spinlock_acquire(&ipt_lock);
+    if (pool->nchunks == pool->maxchunks)
+    {
+        spinlock_release(&ipt_lock);
+        kfree(chunk);
+        return ENOMEM;
+    }
+    pool->chunks[pool->nchunks] = chunk;
+    for (i = POOL_CHUNK - 1; i >= 0; i--)
+    {
+        pool_put(pool, pool->nchunks * POOL_CHUNK + i);
+    }
+    pool->nchunks++;
+    spinlock_release(&ipt_lock);
+
+    return 0;
+}
+
+/*
+ * Make room for a new alias, growing the pools that are empty (the free
+ * lists are only peeked at: the caller looks again with the lock held).
+ * Called without ipt_lock.
+ */
+static int ipt_grow(void)
+{
+    if (alias_pool.free == -1 && pool_grow(&alias_pool))
+    {
+        return ENOMEM;
+    }
+    if (share_pool.free == -1 && pool_grow(&share_pool))
+    {
+        return ENOMEM;
+    }
+    return 0;
+}
+
+static void drop_alias(int a)
+{
+    unlink_mapping(nRamFrames + a);
+    pool_put(&alias_pool, a);
+}
+
+/*
+ * Remove the mapping of pid from the frame at index. If pid owned the frame,
+ * the ownership goes to one of the remaining sharers.
+ * Return 1 if the frame is still mapped by someone else.
+ */
+static int unmap_frame(int index, pid_t pid)
+{
+    int *prev, a;
+
+    if (frame_pid(index) == pid)
+    {
+        unlink_mapping(index);
+        a = frame_alias(index);
+        if (a == -1)
+        {
+            return 0;
+        }
+        /* the first alias becomes the owner */
+        share_at(index)->alias = alias_at(a)->sibling;
+        set_owner(index, key_pid(alias_at(a)->key), frame_vaddr(index));
+        drop_alias(a);
+        link_mapping(index);
+        put_share(index);
+        return 1;
+    }
+
+    for (prev = &share_at(index)->alias; key_pid(alias_at(*prev)->key) != pid; prev = &alias_at(*prev)->sibling)
+    {
+        KASSERT(alias_at(*prev)->sibling != -1);
+    }
+    a = *prev;
+    *prev = alias_at(a)->sibling;
+    drop_alias(a);
+    put_share(index);
+
+    return 1;
+}
+
+/* remove all the mappings of the frame at index */
+static void unmap_all(int index)
+{
+    int a;
+
+    for (a = frame_alias(index); a != -1; a = alias_at(a)->sibling)
+    {
+        drop_alias(a);
+    }
+    if (ipt[index].share != -1)
+    {
+        share_at(index)->alias = -1;
+        put_share(index);
+    }
+    if (frame_pid(index) > 0)
+    {
+        unlink_mapping(index);
+    }
+}
+
+/*
+ * Hash of the text frames, keyed by (executable vnode, vaddr): as the text
+ * segment is mapped at the address written in the ELF, vaddr identifies the
+ * page in the file. Chains are threaded through the next_text field of the
+ * share records. Text is a small part of the frames: a bucket every
+ * TEXT_HASH_RATIO frames.
+ */
+#define TEXT_HASH_RATIO 4
+static int *text_hash = NULL;
+static int nTextBuckets;
+
+static int text_hashfn(struct vnode *vn, vaddr_t vaddr)
+{
+    return ((uintptr_t)vn / sizeof(void *) + vaddr / PAGE_SIZE) % nTextBuckets;
+}
+
+/* unlink a text frame from the text hash, if it is in. Called with ipt_lock held */
+static void text_remove(int index)
+{
+    int *prev;
+
+    if (frame_vn(index) == NULL)
+    {
+        return;
+    }
+
+    prev = &text_hash[text_hashfn(frame_vn(index), frame_vaddr(index))];
+    while (*prev != index)
+    {
+        KASSERT(*prev != -1);
+        prev = &share_at(*prev)->next_text;
+    }
+    *prev = share_at(index)->next_text;
+    share_at(index)->vn = NULL;
+    share_at(index)->next_text = -1;
+    put_share(index);
+}
+
+/* frame holding page vaddr of the executable vn, -1 if none. Called with ipt_lock held */
+static int text_find(struct vnode *vn, vaddr_t vaddr)
+{
+    int index;
+
+    for (index = text_hash[text_hashfn(vn, vaddr)]; index != -1; index = share_at(index)->next_text)
+    {
+        if (share_at(index)->vn == vn && frame_vaddr(index) == vaddr)
+        {
+            break;
+        }
+    }
+
+    return index;
+}
 
 /*DEBUG function used to check the behavior of the page table*/
 void print_ipt(void)
@@ -36,69 +489,201 @@ void print_ipt(void)
 
     for (i = 0; i < nRamFrames; i++)
     {
-        if (ipt[i].pid != -1)
+        if (frame_pid(i) != -1)
         {
-            kprintf("%d -   %d   - %d\n", i, ipt[i].pid, ipt[i].vaddr / PAGE_SIZE);
+            kprintf("%d -   %d   - %d - %d\n", i, frame_pid(i), frame_vaddr(i) / PAGE_SIZE, frame_alias(i) != -1);
         }
     }
     //   spinlock_release(&ipt_lock);
 }
 
+/* Return 1 if pid maps the frame at index. Called with ipt_lock held */
+static int maps_frame(pid_t pid, int index)
+{
+    int a;
+
+    if (frame_pid(index) == pid)
+    {
+        return 1;
+    }
+    for (a = frame_alias(index); a != -1; a = alias_at(a)->sibling)
+    {
+        if (key_pid(alias_at(a)->key) == pid)
+        {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Return the first process after pid (excluded) mapping the frame at index, -1 if none */
+static pid_t find_sharer(int index, pid_t pid)
+{
+    pid_t sharer = frame_pid(index), next = -1;
+    int a;
 
-// TO DO implement per process round robin, not global
-/* return the selected victim */
+    if (sharer > pid)
+    {
+        next = sharer;
+    }
+    for (a = frame_alias(index); a != -1; a = alias_at(a)->sibling)
+    {
+        sharer = key_pid(alias_at(a)->key);
+        if (sharer > pid && (next == -1 || sharer < next))
+        {
+            next = sharer;
+        }
+    }
+    return next;
+}
+
+/*
+ * Reference bits are emulated: the clock hand clears IPT_REF and removes the
+ * translations of the frame from the TLB, so the next access faults and sets
+ * it again. Only the TLB of this cpu is cleared while sweeping: a process
+ * running on another cpu keeps its translation and the frame just loses its
+ * second chance. Called with ipt_lock held.
+ */
+static void clear_reference(int index)
+{
+    pid_t sharer;
+
+    ipt[index].key &= ~IPT_REF;
+    if (frame_alias(index) == -1)
+    {
+        tlb_invalidate_pid_local(frame_pid(index), frame_vaddr(index));
+        return;
+    }
+    for (sharer = find_sharer(index, 0); sharer != -1; sharer = find_sharer(index, sharer))
+    {
+        tlb_invalidate_pid_local(sharer, frame_vaddr(index));
+    }
+}
+
+/* 
+ * return the selected victim, chosen among the frames of all the processes
+ * with the CLOCK (second chance) algorithm.
+ * The victim is locked (IPT_BUSY) and its translations are removed from the
+ * TLBs, but it stays mapped: whoever faults on it waits until the caller has
+ * swapped it out for every sharer (see ipt_next_sharer) and called
+ * ipt_release_victim.
+ */
 paddr_t get_victim(vaddr_t *vaddr, pid_t *pid)
 {
-    int tlb_entry, spl;
+    int i, j, victim = -1, user_frames;
+    pid_t sharer;
 
     spinlock_acquire(&ipt_lock);
     KASSERT(ipt_active);
 
-    /* for each ram frames */
-    for (int i = curproc->last_victim, j = 0; j < nRamFrames; j++, i++)
-    {
-        if (i == nRamFrames)
-        {
-            curproc->last_victim = -1;
-            i = 0;
-        }
-        /* 
-         *Till a ram frame is free (pid == -1) and its position is greater 
-         *than the previous victim .
-         *This guarantees that pages allocated to kernel are not touched and implements a 
-         *round robin policy.
-         */
-        if ((ipt[i].pid == curproc->p_pid))
-        {
-            /* update last victim: if last frame is selected, start again from the beginning */
-            curproc->last_victim = i + 1;
-            *vaddr = ipt[i].vaddr;
-            *pid = ipt[i].pid;
-            /* delete entry from hash */
-            hash_delete(*pid, *vaddr);
-
-            /* free ipt entry: set it as kernel page so that no one can select it as a free while loading it*/
-            ipt[i].pid = -2;
-            /* free tlb entry */
-            spl = splhigh();
-
-            tlb_entry = tlb_probe(ipt[i].vaddr, 0);
-            /* if victim page is in the tlb, invalidate the entry */
-            if (tlb_entry >= 0)
+    while (victim == -1)
+    {
+        user_frames = 0;
+        /* two rounds at most: the first one may only clear reference bits */
+        for (j = 0; j < 2 * nRamFrames; j++)
+        {
+            i = clock_hand;
+            clock_hand = (clock_hand + 1) % nRamFrames;
+            /* free and kernel frames are never selected */
+            if (frame_pid(i) < 0)
             {
-               tlb_write(TLBHI_INVALID(tlb_entry), TLBLO_INVALID(), tlb_entry);
+                continue;
             }
-            splx(spl);
-
-            /* return paddr of victim */
-            spinlock_release(&ipt_lock);
+            user_frames++;
+            /* locked frames are being loaded, used or swapped out by someone else */
+            if (ipt[i].key & IPT_BUSY)
+            {
+                continue;
+            }
+            if (ipt[i].key & IPT_REF)
+            {
+                /* referenced since the last sweep: second chance */
+                clear_reference(i);
+                continue;
+            }
+            victim = i;
+            break;
+        }
 
-            return i * PAGE_SIZE;
+        if (victim == -1)
+        {
+            if (user_frames == 0)
+            {
+                /* error */
+                spinlock_release(&ipt_lock);
+                return 0;
+            }
+            /* all the frames are locked: wait for someone to unlock one */
+            wchan_sleep(ipt_wchan, &ipt_lock);
         }
     }
-    /* error */
+
+    *vaddr = frame_vaddr(victim);
+    *pid = frame_pid(victim);
+    ipt[victim].key |= IPT_BUSY;
+
+    spinlock_release(&ipt_lock);
+
+    /*
+     * The set of sharers cannot change while the frame is locked. Their
+     * translations are removed before the page is written out, so that no one
+     * can modify it meanwhile.
+     */
+    for (sharer = ipt_next_sharer(victim * PAGE_SIZE, 0); sharer != -1; sharer = ipt_next_sharer(victim * PAGE_SIZE, sharer))
+    {
+        tlb_invalidate_pid(sharer, *vaddr);
+    }
+
+    /* return paddr of victim */
+    return victim * PAGE_SIZE;
+}
+
+/*
+ * Return the first process after pid mapping the (busy) victim frame at paddr,
+ * -1 when there are no more. Start with pid = 0.
+ */
+pid_t ipt_next_sharer(paddr_t paddr, pid_t pid)
+{
+    int index = paddr / PAGE_SIZE;
+
+    spinlock_acquire(&ipt_lock);
+    KASSERT(ipt[index].key & IPT_BUSY);
+    pid = find_sharer(index, pid);
     spinlock_release(&ipt_lock);
-    return 0;
+
+    return pid;
+}
+
+/*
+ * Called once a victim has been swapped out for all its sharers:
+ * drop all its mappings and hand it over as a free frame to the caller.
+ */
+void ipt_release_victim(paddr_t paddr)
+{
+    int index = paddr / PAGE_SIZE;
+
+    spinlock_acquire(&ipt_lock);
+    KASSERT(ipt[index].key & IPT_BUSY);
+
+    unmap_all(index);
+    text_remove(index);
+    /* set it as kernel page so that no one can select it as a free while loading it */
+    ipt[index].key = ipt_key(-2, 0);
+    wchan_wakeall(ipt_wchan, &ipt_lock);
+
+    spinlock_release(&ipt_lock);
+}
+
+/* an empty pool of records of size bytes, up to max of them: only the table of its chunks is allocated */
+static int pool_init(struct ipt_pool *pool, size_t size, int max)
+{
+    pool->size = size;
+    pool->nchunks = 0;
+    pool->maxchunks = (max + POOL_CHUNK - 1) / POOL_CHUNK;
+    pool->free = -1;
+    pool->chunks = kmalloc(sizeof(char *) * pool->maxchunks);
+
+    return pool->chunks == NULL ? ENOMEM : 0;
 }
 
 /* 
@@ -112,18 +697,45 @@ int create_ipt(void)
     int i;
     nRamFrames = ((int)ram_getsize()) / PAGE_SIZE;
     KASSERT(nRamFrames != 0);
-    ipt_hash = STinit(nRamFrames);
+    nTextBuckets = (nRamFrames + TEXT_HASH_RATIO - 1) / TEXT_HASH_RATIO;
+    /*
+     * a bucket for each frame at least: the load factor is at most one for
+     * the frames themselves, and reaches IPT_SHARE_FACTOR only if every
+     * frame is shared by IPT_SHARE_FACTOR processes
+     */
+    for (bucket_bits = 1; (1 << bucket_bits) < nRamFrames; bucket_bits++)
+        ;
+    nBuckets = 1 << bucket_bits;
 
     ipt = kmalloc(sizeof(struct ipt_entry) * nRamFrames);
+    ipt_hash = kmalloc(sizeof(int) * nBuckets);
+    text_hash = kmalloc(sizeof(int) * nTextBuckets);
+    ipt_wchan = wchan_create("ipt");
 
-    if (ipt == NULL || ipt_hash == NULL)
+    if (ipt == NULL || ipt_hash == NULL || text_hash == NULL || ipt_wchan == NULL ||
+        pool_init(&alias_pool, sizeof(struct ipt_alias), nRamFrames * (IPT_SHARE_FACTOR - 1)) ||
+        pool_init(&share_pool, sizeof(struct ipt_share), nRamFrames))
     {
         return -1;
     }
     spinlock_acquire(&ipt_lock);
     for (i = 0; i < nRamFrames; i++)
     {
-        ipt[i].pid = -1;
+        ipt[i].key = ipt_key(-1, 0);
+        ipt[i].next = -1;
+        ipt[i].share = -1;
+    }
+    for (i = 0; i < nTextBuckets; i++)
+    {
+        text_hash[i] = -1;
+    }
+    for (i = 0; i < nBuckets; i++)
+    {
+        ipt_hash[i] = -1;
+    }
+    for (i = 0; i <= MAX_PROC; i++)
+    {
+        proc_frames[i] = -1;
     }
     ipt_active = 1;
     spinlock_release(&ipt_lock);
@@ -134,6 +746,19 @@ int create_ipt(void)
 /* Given a pid and vaddr, get the physical frame, if in memory */
 
 paddr_t ipt_lookup(pid_t pid, vaddr_t vaddr)
+{
+    int flags;
+
+    return ipt_lookup_flags(pid, vaddr, &flags);
+}
+
+/*
+ * Same as ipt_lookup, but flags also tells whether the frame is shared
+ * copy-on-write (IPT_SHARED) or is being swapped out (IPT_BUSY): in the
+ * latter case the caller must not use the frame and has to retry later.
+ */
+
+paddr_t ipt_lookup_flags(pid_t pid, vaddr_t vaddr, int *flags)
 {
     int index;
     int paddr;
@@ -142,8 +767,9 @@ paddr_t ipt_lookup(pid_t pid, vaddr_t vaddr)
     spinlock_acquire(&ipt_lock);
     KASSERT(ipt_active);
 
-    index = STsearch(ipt_hash, pid, vaddr);
+    index = hash_lookup(pid, vaddr);
 
+    *flags = 0;
     if (index == -1)
     {
         paddr = 0;
@@ -151,6 +777,11 @@ paddr_t ipt_lookup(pid_t pid, vaddr_t vaddr)
     else
     {
         paddr = index * PAGE_SIZE;
+        *flags = ipt[index].key & (IPT_BUSY | IPT_CLEAN);
+        if (frame_alias(index) != -1)
+        {
+            *flags |= IPT_SHARED;
+        }
     }
 
     spinlock_release(&ipt_lock);
@@ -159,14 +790,329 @@ paddr_t ipt_lookup(pid_t pid, vaddr_t vaddr)
     return paddr;
 }
 
+/*
+ * Lock the frame holding page vaddr of pid, so that it cannot be swapped out
+ * or changed while the caller uses it (e.g. enters it in the TLB). If it is
+ * already locked, wait for its owner to finish: a swap out drops it, so it
+ * may not be in memory anymore afterwards.
+ * Return 0 if the page is not in memory. flags tells whether the frame is
+ * shared copy-on-write (IPT_SHARED) and whether it is clean (IPT_CLEAN).
+ */
+
+paddr_t ipt_lock_frame(pid_t pid, vaddr_t vaddr, int *flags)
+{
+    int index;
+
+    KASSERT(pid > 0);
+    KASSERT(vaddr != 0);
+
+    spinlock_acquire(&ipt_lock);
+    KASSERT(ipt_active);
+
+    index = hash_lookup(pid, vaddr);
+    while (index != -1 && (ipt[index].key & IPT_BUSY))
+    {
+        wchan_sleep(ipt_wchan, &ipt_lock);
+        index = hash_lookup(pid, vaddr);
+    }
+
+    *flags = 0;
+    if (index == -1)
+    {
+        spinlock_release(&ipt_lock);
+        return 0;
+    }
+
+    ipt[index].key |= IPT_BUSY | IPT_REF;
+    *flags = ipt[index].key & IPT_CLEAN;
+    if (frame_alias(index) != -1)
+    {
+        *flags |= IPT_SHARED;
+    }
+
+    spinlock_release(&ipt_lock);
+
+    return index * PAGE_SIZE;
+}
+
+/*
+ * Same as ipt_lock_frame, without waiting: return 0 if the frame is not
+ * resident or someone else holds it.
+ */
+paddr_t ipt_trylock_frame(pid_t pid, vaddr_t vaddr, int *flags)
+{
+    int index;
+
+    KASSERT(pid > 0);
+    KASSERT(vaddr != 0);
+
+    spinlock_acquire(&ipt_lock);
+    KASSERT(ipt_active);
+
+    *flags = 0;
+    index = hash_lookup(pid, vaddr);
+    if (index == -1 || (ipt[index].key & IPT_BUSY))
+    {
+        spinlock_release(&ipt_lock);
+        return 0;
+    }
+
+    ipt[index].key |= IPT_BUSY | IPT_REF;
+    *flags = ipt[index].key & IPT_CLEAN;
+    if (frame_alias(index) != -1)
+    {
+        *flags |= IPT_SHARED;
+    }
+
+    spinlock_release(&ipt_lock);
+
+    return index * PAGE_SIZE;
+}
+
+void ipt_unlock_frame(paddr_t paddr)
+{
+    int index = paddr / PAGE_SIZE;
+
+    spinlock_acquire(&ipt_lock);
+    KASSERT(ipt[index].key & IPT_BUSY);
+    ipt[index].key &= ~IPT_BUSY;
+    wchan_wakeall(ipt_wchan, &ipt_lock);
+    spinlock_release(&ipt_lock);
+}
+
+/*
+ * A clean frame has not been written since it was read from the swapfile or,
+ * for a data page, from the ELF file: every process mapping it has an entry
+ * in the swapfile referring to a slot with the same content or, if it has
+ * none, finds the same content in the ELF file. So the frame can be dropped
+ * without writing it. It is mapped read-only until the first write, that
+ * makes it dirty.
+ * Called with the frame locked.
+ */
+void ipt_set_clean(paddr_t paddr, int clean)
+{
+    int index = paddr / PAGE_SIZE;
+
+    spinlock_acquire(&ipt_lock);
+    KASSERT(ipt[index].key & IPT_BUSY);
+    if (clean)
+    {
+        ipt[index].key |= IPT_CLEAN;
+    }
+    else
+    {
+        ipt[index].key &= ~IPT_CLEAN;
+    }
+    spinlock_release(&ipt_lock);
+}
+
+int ipt_is_clean(paddr_t paddr)
+{
+    int index = paddr / PAGE_SIZE, clean;
+
+    spinlock_acquire(&ipt_lock);
+    clean = (ipt[index].key & IPT_CLEAN) != 0;
+    spinlock_release(&ipt_lock);
+
+    return clean;
+}
+
+/*
+ * Copy-on-write fork of all the resident data and stack pages of old_pid
+ * (text frames are found again by the child through the text hash).
+ * Only the frames of old_pid are visited.
+ * Return ENOMEM if the aliases for the new mappings cannot be allocated.
+ */
+
+int ipt_share_process(pid_t old_pid, pid_t new_pid)
+{
+    int n, index;
+
+    KASSERT(old_pid > 0 && new_pid > 0);
+
+    spinlock_acquire(&ipt_lock);
+    KASSERT(ipt_active);
+
+    n = proc_frames[old_pid];
+    while (n != -1)
+    {
+        index = chain_frame(n);
+        n = *proc_next(n);
+        if (frame_vn(index) != NULL || maps_frame(new_pid, index))
+        {
+            continue;
+        }
+        /* wait for a swap out in progress to complete, the list may change meanwhile */
+        if (ipt[index].key & IPT_BUSY)
+        {
+            wchan_sleep(ipt_wchan, &ipt_lock);
+            n = proc_frames[old_pid];
+            continue;
+        }
+        if (add_alias(index, new_pid))
+        {
+            /* frames already shared are skipped when the list is walked again */
+            spinlock_release(&ipt_lock);
+            if (ipt_grow())
+            {
+                return ENOMEM;
+            }
+            spinlock_acquire(&ipt_lock);
+            n = proc_frames[old_pid];
+            continue;
+        }
+        /* old_pid is the current process: its next write must fault and copy */
+        tlb_invalidate_vaddr(frame_vaddr(index));
+    }
+
+    spinlock_release(&ipt_lock);
+
+    return 0;
+}
+
+/*
+ * Remove the mapping of pid from a shared frame, after it has got its own copy.
+ * If pid owned the entry, the ownership goes to one of the remaining sharers.
+ */
+
+void ipt_unshare(pid_t pid, paddr_t paddr, vaddr_t vaddr)
+{
+    int index = paddr / PAGE_SIZE;
+
+    spinlock_acquire(&ipt_lock);
+    KASSERT(frame_alias(index) != -1);
+    KASSERT(hash_lookup(pid, vaddr) == index);
+
+    unmap_frame(index, pid);
+
+    spinlock_release(&ipt_lock);
+}
+
+/*
+ * Look for page vaddr of the executable vn among the text frames already
+ * loaded by other processes. If it is there, map it also for pid and
+ * return 0 with its address, locked, in paddr. Otherwise return ENOENT and
+ * the caller loads the page, or ENOMEM if the page is there but no alias can
+ * be allocated to map it: the caller loads a copy of its own, that is not
+ * shared (see ipt_text_add).
+ * A frame still being loaded by another process is waited for.
+ */
+
+int ipt_text_lookup(pid_t pid, struct vnode *vn, vaddr_t vaddr, paddr_t *paddr)
+{
+    int index, result;
+
+    KASSERT(pid > 0);
+    KASSERT(vn != NULL);
+
+    spinlock_acquire(&ipt_lock);
+    KASSERT(ipt_active);
+
+    for (;;)
+    {
+        while ((index = text_find(vn, vaddr)) != -1 && (ipt[index].key & IPT_BUSY))
+        {
+            wchan_sleep(ipt_wchan, &ipt_lock);
+        }
+
+        result = index == -1 ? ENOENT : add_alias(index, pid);
+        if (result != ENOMEM)
+        {
+            break;
+        }
+        /* the frame may be gone once the lock is taken again: look for it again */
+        spinlock_release(&ipt_lock);
+        if (ipt_grow())
+        {
+            return ENOMEM;
+        }
+        spinlock_acquire(&ipt_lock);
+    }
+    if (result)
+    {
+        spinlock_release(&ipt_lock);
+        /* the caller adds the page with ipt_text_add: have a share record ready for it */
+        if (share_pool.free == -1)
+        {
+            pool_grow(&share_pool);
+        }
+        return result;
+    }
+
+    ipt[index].key |= IPT_BUSY | IPT_REF;
+
+    spinlock_release(&ipt_lock);
+
+    *paddr = index * PAGE_SIZE;
+    return 0;
+}
+
+/*
+ * Add a text frame of the executable vn, about to be loaded, to the ipt (as
+ * ipt_add does) and make it available to the other processes running it:
+ * they wait until it is unlocked. If there is no share record for it, the
+ * frame is just not shared, as a copy of the page of its own.
+ * Return EEXIST, without adding anything, if another process got there
+ * first: the caller frees its frame and looks again.
+ */
+
+int ipt_text_add(pid_t pid, paddr_t paddr, vaddr_t vaddr, struct vnode *vn)
+{
+    int index = paddr / PAGE_SIZE, bucket;
+
+    KASSERT(pid > 0);
+    KASSERT(vn != NULL);
+
+    spinlock_acquire(&ipt_lock);
+    KASSERT(ipt_active);
+
+    if (text_find(vn, vaddr) != -1)
+    {
+        spinlock_release(&ipt_lock);
+        return EEXIST;
+    }
+
+    ipt[index].key = ipt_key(pid, vaddr) | IPT_BUSY | IPT_REF;
+    ipt[index].share = -1;
+    link_mapping(index);
+
+    if (get_share(index) == 0)
+    {
+        bucket = text_hashfn(vn, vaddr);
+        share_at(index)->vn = vn;
+        share_at(index)->next_text = text_hash[bucket];
+        text_hash[bucket] = index;
+    }
+
+    spinlock_release(&ipt_lock);
+
+    return 0;
+}
+
+/*
+ * The frame at paddr, added locked by ipt_add or ipt_text_add, could not be
+ * loaded: remove its mappings, so that nobody finds it. It stays locked
+ * until the caller frees it.
+ */
+void ipt_drop_frame(paddr_t paddr)
+{
+    int index = paddr / PAGE_SIZE;
+
+    spinlock_acquire(&ipt_lock);
+    KASSERT(ipt[index].key & IPT_BUSY);
+    text_remove(index);
+    unmap_all(index);
+    spinlock_release(&ipt_lock);
+}
+
 /* 
  * Convinience function used to add an entry in the ipt.
+ * The frame is added locked: the caller unlocks it once it is in the TLB.
  */
 
 int ipt_add(pid_t pid, paddr_t paddr, vaddr_t vaddr)
 {
     int frame_index;
-    Item item;
     KASSERT(pid >= 0);
     KASSERT(paddr != 0);
     KASSERT(vaddr != 0);
@@ -177,15 +1123,11 @@ int ipt_add(pid_t pid, paddr_t paddr, vaddr_t vaddr)
     spinlock_acquire(&ipt_lock);
     if (ipt_active)
     {
-
-        item = ITEMscan(pid, vaddr, frame_index);
-        KASSERT(ipt_active);
-        ipt[frame_index].pid = pid;
-        ipt[frame_index].vaddr = vaddr;
+        ipt[frame_index].key = ipt_key(pid, vaddr) | IPT_BUSY | IPT_REF;
+        ipt[frame_index].share = -1;
 
         /*Add entry to hash table*/
-        STinsert(ipt_hash, item);
-        // STdisplay(ipt_hash);
+        link_mapping(frame_index);
     }
     spinlock_release(&ipt_lock);
 
@@ -202,8 +1144,13 @@ int ipt_kadd(pid_t pid, paddr_t paddr, vaddr_t vaddr)
     spinlock_acquire(&ipt_lock);
     if (ipt_active)
     {
-        ipt[frame_index].pid = pid;
-        ipt[frame_index].vaddr = vaddr;
+        /* a frame dropped while locked (see ipt_drop_frame) is freed */
+        if (ipt[frame_index].key & IPT_BUSY)
+        {
+            wchan_wakeall(ipt_wchan, &ipt_lock);
+        }
+        ipt[frame_index].key = ipt_key(pid, vaddr);
+        ipt[frame_index].share = -1;
     }
     spinlock_release(&ipt_lock);
 
@@ -214,25 +1161,42 @@ int ipt_kadd(pid_t pid, paddr_t paddr, vaddr_t vaddr)
  * Convinience function to free all the enter of a process.
  * Normally during the __exit of a process to free IPT entries
  * and frame entries (in coremap).
+ * Frames shared copy-on-write are freed only by their last user.
+ * Only the frames in the list of the process are visited.
  */
 
 void free_ipt_process(pid_t pid)
 {
     int i, result;
+
+    /*
+     * nothing to do for the software TLBs: their entries are tagged with
+     * the ASIDs of the process, that are not given out again before every
+     * cpu has flushed them
+     */
+
     spinlock_acquire(&ipt_lock);
     KASSERT(ipt_active);
 
-    for (i = 0; i < nRamFrames; i++)
+    while (proc_frames[pid] != -1)
     {
-        if (ipt[i].pid == pid)
+        i = chain_frame(proc_frames[pid]);
+        /* a shared frame being swapped out, wait for it and look again */
+        if (ipt[i].key & IPT_BUSY)
         {
-            ipt[i].pid = -1;
-            result = freeppages(i * PAGE_SIZE, i);
-            if (result == 0)
-            {
-                panic("Trying to free ipt entry while VM not active");
-            }
-            STdelete(ipt_hash, pid, ipt[i].vaddr);
+            wchan_sleep(ipt_wchan, &ipt_lock);
+            continue;
+        }
+        if (unmap_frame(i, pid))
+        {
+            continue;
+        }
+        text_remove(i);
+        ipt[i].key = ipt_key(-1, 0);
+        result = freeppages(i * PAGE_SIZE, i);
+        if (result == 0)
+        {
+            panic("Trying to free ipt entry while VM not active");
         }
     }
     spinlock_release(&ipt_lock);
@@ -240,14 +1204,71 @@ void free_ipt_process(pid_t pid)
 
 int hash_delete(pid_t pid, vaddr_t vaddr)
 {
+    int index;
+
     KASSERT(pid > 0);
     KASSERT(vaddr < 0x80000000);
-    STdelete(ipt_hash, pid, vaddr);
+
+    spinlock_acquire(&ipt_lock);
+    index = hash_lookup(pid, vaddr);
+    if (index != -1)
+    {
+        unmap_frame(index, pid);
+    }
+    spinlock_release(&ipt_lock);
 
     return 0;
 }
 
+/* bytes taken by the records of pool, and by the table of its chunks */
+static int pool_bytes(struct ipt_pool *pool)
+{
+    return pool->nchunks * POOL_CHUNK * pool->size + pool->maxchunks * sizeof(char *);
+}
+
+/* print the length of the chains of the ipt hash, and the memory taken by the ipt */
 void hash_print(void)
 {
-    STdisplay(ipt_hash);
+    int i, n, len, max = 0, entries = 0, used = 0, fixed, records;
+    int histogram[HASH_HISTOGRAM_SIZE];
+
+    for (i = 0; i < HASH_HISTOGRAM_SIZE; i++)
+    {
+        histogram[i] = 0;
+    }
+
+    spinlock_acquire(&ipt_lock);
+    for (i = 0; i < nBuckets; i++)
+    {
+        len = 0;
+        for (n = ipt_hash[i]; n != -1; n = *chain_next(n))
+        {
+            len++;
+        }
+        entries += len;
+        if (len > 0)
+        {
+            used++;
+        }
+        if (len > max)
+        {
+            max = len;
+        }
+        histogram[len < HASH_HISTOGRAM_SIZE - 1 ? len : HASH_HISTOGRAM_SIZE - 1]++;
+    }
+    fixed = nRamFrames * sizeof(struct ipt_entry) + (nBuckets + nTextBuckets) * sizeof(int);
+    records = pool_bytes(&alias_pool) + pool_bytes(&share_pool);
+    spinlock_release(&ipt_lock);
+
+    kprintf("IPT memory: %d bytes (%d per frame), %d in aliases and share records\n",
+            fixed + records, (fixed + records) / nRamFrames, records);
+
+    kprintf("IPT hash: %d buckets, %d entries, %d used buckets\n", nBuckets, entries, used);
+    /* mean length of the chains that are not empty, that a lookup walks */
+    kprintf("Chain length: max %d, mean %d.%02d\n", max,
+            used ? entries / used : 0, used ? (entries % used) * 100 / used : 0);
+    for (i = 0; i < HASH_HISTOGRAM_SIZE; i++)
+    {
+        kprintf("%s%d: %d\n", i == HASH_HISTOGRAM_SIZE - 1 ? ">=" : "  ", i, histogram[i]);
+    }
 }
\ No newline at end of file
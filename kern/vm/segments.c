@@ -13,134 +13,30 @@
 #include <vfs.h>
 #include <instrumentation.h>
 #include <pt.h>
+#include <vm_tlb.h>
 /*
- * Load a segment at virtual address VADDR. The segment in memory
- * extends from VADDR up to (but not including) VADDR+MEMSIZE. The
- * segment on disk is located at file offset OFFSET and has length
- * FILESIZE.
- *
- * FILESIZE may be less than MEMSIZE; if so the remaining portion of
- * the in-memory segment should be zero-filled.
- *
- * Note that uiomove will catch it if someone tries to load an
- * executable whose load address is in kernel space. If you should
- * change this code to not use uiomove, be sure to check for this case
- * explicitly.
+ * Load n consecutive pages of a segment, starting from the one at
+ * page_offset_from_segbase, in the frames paddr[0..n-1], with a single read
+ * of the ELF file. The pages after the first must be entirely file data:
+ * only the first one can be partial, or in the BSS (n is 1 then).
  */
-
-static int
-load_segment(struct addrspace *as, struct vnode *v,
-			 off_t offset, vaddr_t vaddr,
-			 size_t memsize, size_t filesize,
-			 int is_executable, paddr_t paddr)
+int load_pages(vaddr_t page_offset_from_segbase, int segment, paddr_t *paddr, int n)
 {
-
-	struct iovec iov;
+	struct iovec iov[FAULTAROUND_MAX];
 	struct uio u;
-	int result;
-	paddr_t addr;
-
-	KASSERT(curproc->p_addrspace == as);
-	(void)is_executable;
-
-	if (filesize > memsize)
-	{
-		kprintf("ELF: warning: segment filesize > segment memsize\n");
-		filesize = memsize;
-	}
-
-	DEBUG(DB_EXEC, "ELF: Loading %lu bytes to 0x%lx\n",
-		  (unsigned long)filesize, (unsigned long)vaddr);
-
-	addr = vaddr - (vaddr & PAGE_FRAME) + paddr;
-
-	iov.iov_ubase = (userptr_t)PADDR_TO_KVADDR(addr);
-	iov.iov_len = memsize; // length of the memory space
-	u.uio_iov = &iov;
-	u.uio_iovcnt = 1;
-	u.uio_resid = filesize; // amount to read from the file
-	u.uio_offset = offset;
-	u.uio_segflg = UIO_SYSSPACE;
-	u.uio_rw = UIO_READ;
-	u.uio_space = NULL;
-
-	result = VOP_READ(v, &u);
-	if (result)
-	{
-		return result;
-	}
-
-	if (u.uio_resid != 0)
-	{
-		kprintf("ELF: short read on segment - file truncated?\n");
-		return ENOEXEC;
-	}
-
-	/* * If memsize > filesize, the remaining space should be
-	 * zero-filled. There is no need to do this explicitly,
-	 * because the VM system should provide pages that do not
-	 * contain other processes' data, i.e., are already zeroed.
-	 *
-	 * During development of your VM system, it may have bugs that
-	 * cause it to (maybe only sometimes) not provide zero-filled
-	 * pages, which can cause user programs to fail in strange
-	 * ways. Explicitly zeroing program BSS may help identify such
-	 * bugs, so the following disabled code is provided as a
-	 * diagnostic tool. Note that it must be disabled again before
-	 * you submit your code for grading.*/
-
-#if 0
-	{
-		size_t fillamt;
-
-		fillamt = memsize - filesize;
-		if (fillamt > 0)
-		{
-			DEBUG(DB_EXEC, "ELF: Zero-filling %lu more bytes\n",
-				  (unsigned long)fillamt);
-			u.uio_resid += fillamt;
-			result = uiomovezeros(fillamt, &u);
-		}
-	}
-#endif
-
-	return result;
-}
-
-int load_page(vaddr_t page_offset_from_segbase, vaddr_t vaddr, int segment, paddr_t paddr)
-{
-
-	int bytes_toread_from_file;
+	struct addrspace *as = curproc->p_addrspace;
 	struct vnode *v;
-	int result;
-	struct iovec iov;
-	struct uio ku;
-	Elf_Ehdr eh = curproc->p_eh;
+	vaddr_t page, lo, hi, start, end;
+	int result, k;
 	Elf_Phdr ph;
 
-	/* Open the file. */
-	result = vfs_open(curproc->p_name, O_RDONLY, 0, &v);
-	if (result)
-	{
-		return result;
-	}
-
-	/* read the program header for the needed segment */
-	off_t offset = eh.e_phoff + segment * eh.e_phentsize;
-	uio_kinit(&iov, &ku, &ph, sizeof(ph), offset, UIO_READ);
+	KASSERT(n >= 1 && n <= FAULTAROUND_MAX);
 
-	result = VOP_READ(v, &ku);
-	if (result)
-	{
-		return result;
-	}
-
-	if (ku.uio_resid != 0)
-	{
-		/* short read; problem with executable? */
-		kprintf("ELF: short read on phdr - file truncated?\n");
-		return ENOEXEC;
-	}
+	/* executable and program headers are cached in the address space by load_elf() */
+	KASSERT(as->as_vnode != NULL);
+	KASSERT(segment < as->as_phnum);
+	v = as->as_vnode;
+	ph = as->as_ph[segment];
 
 	switch (ph.p_type)
 	{
@@ -190,90 +86,118 @@ int load_page(vaddr_t page_offset_from_segbase, vaddr_t vaddr, int segment, padd
 	 * In the last case, (3), things are easy and similar to (2). The only true difference is that the amount of bytes
 	 * that we read could be less than PAGE_SIZE. For example: 0444 4444 4400. In this case, when reading the last page, we 
 	 * have to read just 44 and not the whole page (which is not present in the file). This can be easily prevented.
+	 *
+	 * All three cases come down to reading the part of the pages that overlaps the file data of the
+	 * segment, [p_vaddr, p_vaddr + p_filesz), from the file offset of its first byte. When more pages
+	 * are read at once, the ones after the first are whole pages of file data (see load_page_fills_frame()),
+	 * so the file data is contiguous in the frames but for the padding at the start of the first one.
 	 */
 
-	/* 
-	 * vaddr is the address of the page where the fault occured, that must be equal to the page-aligned
-	 * starting segment address + the offset from it of the page we want to read.
-	 */
-	KASSERT(vaddr == ((ph.p_vaddr & PAGE_FRAME) + page_offset_from_segbase));
-
-	/* bytes_to_align_first stores the padding bytes (if any) of the first page (example: 00044, it will contain 3) */
-
-	int bytes_to_align_first = ph.p_vaddr - (ph.p_vaddr & PAGE_FRAME);
+	/* first page to load, and part of the pages to read from the file */
+	page = (ph.p_vaddr & PAGE_FRAME) + page_offset_from_segbase;
+	lo = page > ph.p_vaddr ? page : ph.p_vaddr;
+	hi = page + n * PAGE_SIZE;
+	if (hi > ph.p_vaddr + ph.p_filesz)
+	{
+		hi = ph.p_vaddr + ph.p_filesz;
+	}
 
-	/* if the page we want is greater than the segment size, it means that we have to just allocate an empty page */
+	/* if the page we want is past the file data of the segment, it is just an empty page */
 	/* 1111 1111 1111  filesz: 3 memsz: 300 */
-
-	if (page_offset_from_segbase >= ph.p_filesz + bytes_to_align_first)
+	if (hi <= lo)
 	{
+		KASSERT(n == 1);
 		increase(NEW_PAGE_ZEROED);
-		result = 0;
+		return as_complete_load(as);
 	}
-	else /* else, we have to read from file */
-	{
-		increase(FAULT_WITH_LOAD);
-		increase(FAULT_WITH_ELF_LOAD);
-
-		/* 
-		 * load the needed page .
-		 */
 
-		/* if we want to read the first page */
-		if (page_offset_from_segbase == 0)
-		{
-			vaddr = ph.p_vaddr;
-			/* amount of bytes to read */
+	increase(FAULT_WITH_LOAD);
+	increase(FAULT_WITH_ELF_LOAD);
 
-				// 00110 
-			if (ph.p_vaddr + ph.p_filesz < (ph.p_vaddr & PAGE_FRAME) + PAGE_SIZE)
-			{
-				bytes_toread_from_file = ph.p_filesz;
-			}
-			else
-			{  //00111 11111
-				bytes_toread_from_file = ((ph.p_vaddr & PAGE_FRAME) + PAGE_SIZE) - ph.p_vaddr;
-			}
-		}
+	DEBUG(DB_EXEC, "ELF: Loading %lu bytes to 0x%lx\n",
+		  (unsigned long)(hi - lo), (unsigned long)lo);
 
-		/*
-		 * Last page reading
-		 * if  ph.p_filesz-page (segment size minus offset of page) is less than PAGE_SIZE, 
-		 * read the remaning part (less than PAGE_SIZE)
-		 */
-		else if (bytes_to_align_first + ph.p_filesz - page_offset_from_segbase < PAGE_SIZE)
+	/* one iovec for each frame, covering its part of [lo, hi) */
+	for (k = 0; k < n; k++)
+	{
+		start = k == 0 ? lo : page + k * PAGE_SIZE;
+		end = page + (k + 1) * PAGE_SIZE;
+		if (end > hi)
 		{
-			/* 
-			 * we have to compesate for the possible padding present in the first page 
-			 * We take offset from the last page we remove the first page and we add only the portion of the 
-			 * first page that is truly present in the file.
-			 * Ex.  0111 1111 1100 -> we have to remove the first 0
-			 */
-			page_offset_from_segbase = page_offset_from_segbase - PAGE_SIZE + (((ph.p_vaddr & PAGE_FRAME) + PAGE_SIZE) - ph.p_vaddr);
-			bytes_toread_from_file = bytes_to_align_first + ph.p_filesz - page_offset_from_segbase;
+			end = hi;
 		}
-		/* middle page read PAGE_SIZE */
-		else
+		KASSERT(k == 0 || end - start == PAGE_SIZE);
+
+		iov[k].iov_ubase = (userptr_t)PADDR_TO_KVADDR(paddr[k] + (start - (page + k * PAGE_SIZE)));
+		iov[k].iov_len = end - start;
+		if (k > 0)
 		{
-			page_offset_from_segbase = page_offset_from_segbase - PAGE_SIZE + ((ph.p_vaddr & PAGE_FRAME) + PAGE_SIZE) - ph.p_vaddr;
-			bytes_toread_from_file = PAGE_SIZE;
+			increase(ELF_READAROUND);
 		}
-
-		result = load_segment(curproc->p_addrspace, v, ph.p_offset + page_offset_from_segbase, vaddr,
-							  PAGE_SIZE, bytes_toread_from_file,
-							  ph.p_flags & PF_X, paddr);
 	}
 
+	u.uio_iov = iov;
+	u.uio_iovcnt = n;
+	u.uio_resid = hi - lo; // amount to read from the file
+	u.uio_offset = ph.p_offset + (lo - ph.p_vaddr);
+	u.uio_segflg = UIO_SYSSPACE;
+	u.uio_rw = UIO_READ;
+	u.uio_space = NULL;
+
+	result = VOP_READ(v, &u);
 	if (result)
 	{
 		return result;
 	}
 
-	result = as_complete_load(curproc->p_addrspace);
-	if (result)
+	if (u.uio_resid != 0)
 	{
-		return result;
+		kprintf("ELF: short read on segment - file truncated?\n");
+		return ENOEXEC;
+	}
+
+	return as_complete_load(as);
+}
+
+/*
+ * Return 1 if load_pages() fills the whole frame with data read from the
+ * file, so that the frame does not have to be zeroed before the load:
+ * the page must not contain the start of the segment nor the end of its
+ * file data.
+ */
+int load_page_fills_frame(vaddr_t page_offset_from_segbase, int segment)
+{
+	struct addrspace *as = curproc->p_addrspace;
+	Elf_Phdr *ph;
+	vaddr_t bytes_to_align_first;
+
+	KASSERT(segment < as->as_phnum);
+	ph = &as->as_ph[segment];
+	if (ph->p_type != PT_LOAD)
+	{
+		return 0;
+	}
+	bytes_to_align_first = ph->p_vaddr - (ph->p_vaddr & PAGE_FRAME);
+
+	return page_offset_from_segbase >= bytes_to_align_first &&
+		   page_offset_from_segbase + PAGE_SIZE <= bytes_to_align_first + ph->p_filesz;
+}
+
+/*
+ * Return 1 if the page has no data from the file (it is past the end of the
+ * file data of the segment, in the BSS): load_pages() would just zero it.
+ */
+int load_page_is_zero(vaddr_t page_offset_from_segbase, int segment)
+{
+	struct addrspace *as = curproc->p_addrspace;
+	Elf_Phdr *ph;
+
+	KASSERT(segment < as->as_phnum);
+	ph = &as->as_ph[segment];
+	if (ph->p_type != PT_LOAD)
+	{
+		return 0;
 	}
 
-	return 0;
-}
\ No newline at end of file
+	return page_offset_from_segbase >= ph->p_filesz + (ph->p_vaddr - (ph->p_vaddr & PAGE_FRAME));
+}
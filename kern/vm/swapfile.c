@@ -17,94 +17,236 @@
 #include <opt-list.h>
 #include <addrspace.h>
 #include <coremap.h>
+#include <pt.h>
+#include <stat.h>
+#include <zswap.h>
 
 #define DUMPOUT 0
 #define DUMPIN 0
 
+/*
+ * A swap device: a raw disk attached with vfs_swapon(), or the SWAPFILE.
+ * The slots of all the devices are numbered in a single space, each device
+ * holding nslots slots starting at first. Each device has its own allocator,
+ * so that a cluster of pages is never split between two devices.
+ */
+struct swap_device
+{
+    const char *name;
+    struct vnode *vn;
+    int priority;
+    int first, nslots;
+    /* slots in use */
+    int used;
 #if OPT_LIST
+    struct swap_slot *free_slots;
+#else
+    /* where the next-fit search starts */
+    int next_fit;
+#endif
+    /* I/O operations and pages moved */
+    long int reads, writes, pages_in, pages_out;
+};
 
-int swap_fd;
-
-static struct swap_entry *free_list_head;
-static struct swap_entry *free_list_tail;
+static const struct
+{
+    const char *name;
+    int priority;
+} swap_config[] = SWAP_DEVICES;
 
-static struct swap_entry *swap_list;
-static struct vnode *v = NULL;
 static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
 
-static void add_free_entry(struct swap_entry *fentry)
+/* sorted by decreasing priority */
+static struct swap_device swap_devs[MAX_SWAP_DEVICES];
+static int swap_ndevs;
+/* turn of the devices with the same priority */
+static unsigned swap_rr;
+
+/* number of slots (pages) of the swap area, and of entries */
+static int swap_entries;
+/* buckets of the (pid, page) hash of the entries: a power of two, at least swap_entries */
+static int swap_hash_bits;
+static int swap_buckets;
+
+/*
+ * Fibonacci hashing of (vpn << 7 ^ pid): summing vpn and pid made
+ * neighbouring pages of neighbouring pids collide.
+ */
+static int swap_hashfn(pid_t pid, vaddr_t page)
 {
-    fentry->next = free_list_head->next;
-    free_list_head->next = fentry;
+    return ((uint32_t)(page / PAGE_SIZE << 7 ^ pid) * 2654435769U) >> (32 - swap_hash_bits);
 }
 
-static struct swap_entry *search_swap_list(pid_t pid, vaddr_t vaddr)
+static void swap_hash_size(void)
 {
-    struct swap_entry *tmp;
+    for (swap_hash_bits = 1; (1 << swap_hash_bits) < swap_entries; swap_hash_bits++)
+        ;
+    swap_buckets = 1 << swap_hash_bits;
+}
 
-    tmp = swap_list->next;
+/* attach a swap device, keeping swap_devs sorted */
+static void swap_add_device(const char *name, struct vnode *vn, int priority, int nslots)
+{
+    int i;
 
-    for (int i = 0; i < ENTRIES; i++)
+    KASSERT(swap_ndevs < MAX_SWAP_DEVICES);
+    for (i = swap_ndevs; i > 0 && swap_devs[i - 1].priority < priority; i--)
     {
-        if (tmp == free_list_tail)
+        swap_devs[i] = swap_devs[i - 1];
+    }
+    bzero(&swap_devs[i], sizeof(struct swap_device));
+    swap_devs[i].name = name;
+    swap_devs[i].vn = vn;
+    swap_devs[i].priority = priority;
+    swap_devs[i].nslots = nslots;
+    swap_ndevs++;
+
+    kprintf("swap: %s: %d pages, priority %d\n", name, nslots, priority);
+}
+
+/*
+ * Open the swap area: the raw disks in SWAP_DEVICES, attached with
+ * vfs_swapon(), or the SWAPFILE if none of them is there (or they are
+ * mounted). The disks are read and written directly with multi-sector I/O,
+ * with no file system (and no vfs_biglock) in between. Return the number of
+ * slots.
+ */
+static int swap_open(void)
+{
+    struct stat st;
+    struct vnode *vn;
+    unsigned i;
+    int result, nslots = 0;
+
+    for (i = 0; i < sizeof(swap_config) / sizeof(swap_config[0]) && swap_ndevs < MAX_SWAP_DEVICES; i++)
+    {
+        result = vfs_swapon(swap_config[i].name, &vn);
+        if (result)
+        {
+            continue;
+        }
+        result = VOP_STAT(vn, &st);
+        if (result == 0 && st.st_size >= PAGE_SIZE)
         {
-            return NULL;
+            swap_add_device(swap_config[i].name, vn, swap_config[i].priority, st.st_size / PAGE_SIZE);
+            continue;
         }
+        VOP_DECREF(vn);
+        vfs_swapoff(swap_config[i].name);
+    }
 
-        if (tmp->pid == pid && tmp->page == vaddr)
+    if (swap_ndevs == 0)
+    {
+        result = vfs_open((char *)"./SWAPFILE", O_RDWR | O_CREAT | O_TRUNC, 777, &vn);
+        if (result)
         {
-            return tmp;
+            panic("swap: cannot open SWAPFILE\n");
         }
+        swap_add_device("SWAPFILE", vn, 0, MAX_SIZE / PAGE_SIZE);
+    }
 
-        tmp = tmp->next;
+    for (i = 0; i < (unsigned)swap_ndevs; i++)
+    {
+        swap_devs[i].first = nslots;
+        nslots += swap_devs[i].nslots;
     }
 
-    panic("Should not get here while searching in swap list\n");
+    return nslots;
 }
 
-static struct swap_entry *search_swap_list_pid(pid_t pid, struct swap_entry **tmp)
+/*
+ * The i-th device to try for a write: devices are tried by decreasing
+ * priority and, among the ones with the same priority, starting from a
+ * different one each time (swap_rr), so that consecutive clusters are
+ * striped over them and written in parallel by different threads.
+ * Called with swap_lock held.
+ */
+static struct swap_device *swap_candidate(int i)
 {
+    int first, last;
+
+    for (first = i; first > 0 && swap_devs[first - 1].priority == swap_devs[i].priority; first--)
+        ;
+    for (last = i; last < swap_ndevs && swap_devs[last].priority == swap_devs[i].priority; last++)
+        ;
+
+    return &swap_devs[first + (i - first + swap_rr) % (last - first)];
+}
+
+/* the device holding slot */
+static struct swap_device *swap_device_of(int slot)
+{
+    int i;
+
+    for (i = swap_ndevs - 1; swap_devs[i].first > slot; i--)
+        ;
+
+    return &swap_devs[i];
+}
+
+void print_swap_devices(void)
+{
+    int i;
+
     spinlock_acquire(&swap_lock);
-    
-    if (*tmp == NULL)
+    for (i = 0; i < swap_ndevs; i++)
     {
-        *tmp = swap_list->next;
+        kprintf("Swap device %s (priority %d): %d/%d slots used\n", swap_devs[i].name, swap_devs[i].priority, swap_devs[i].used, swap_devs[i].nslots);
+        kprintf("    reads: %ld (%ld pages), writes: %ld (%ld pages)\n", swap_devs[i].reads, swap_devs[i].pages_in, swap_devs[i].writes, swap_devs[i].pages_out);
     }
+    spinlock_release(&swap_lock);
+}
 
-    for (int i = 0; i < ENTRIES; i++)
-    {
-        if (*tmp == free_list_tail)
-        {
-            return NULL;
-            spinlock_release(&swap_lock);
+#if OPT_LIST
 
-        }
+int swap_fd;
+
+static struct swap_entry *free_list_head;
+static struct swap_entry *free_list_tail;
 
-        if ((*tmp)->pid == pid)
+static struct swap_entry *swap_list;
+
+/* entries of swap_list, also chained by (pid, page) through hash_next */
+static struct swap_entry **swap_hash;
+
+static void add_free_entry(struct swap_entry *fentry)
+{
+    fentry->next = free_list_head->next;
+    free_list_head->next = fentry;
+}
+
+static struct swap_entry *search_swap_list(pid_t pid, vaddr_t vaddr)
+{
+    struct swap_entry *tmp;
+
+    for (tmp = swap_hash[swap_hashfn(pid, vaddr)]; tmp != NULL; tmp = tmp->hash_next)
+    {
+        if (tmp->pid == pid && tmp->page == vaddr)
         {
-            spinlock_release(&swap_lock);
-            return *tmp;
+            return tmp;
         }
-
-        *tmp = (*tmp)->next;
     }
 
-    panic("Should not get here while searching in swap list\n");
+    return NULL;
 }
 
 static void add_swap_list(struct swap_entry *entry)
 {
+    int h = swap_hashfn(entry->pid, entry->page);
 
     entry->next = swap_list->next;
     entry->previous = swap_list;
     swap_list->next->previous = entry;
     swap_list->next = entry;
+
+    entry->hash_next = swap_hash[h];
+    swap_hash[h] = entry;
 }
 
 static void remove_swap_list(struct swap_entry *entry)
 {
 
-    struct swap_entry *prev, *next;
+    struct swap_entry *prev, *next, **hprev;
 
     KASSERT(entry != swap_list && entry != free_list_tail);
 
@@ -112,6 +254,14 @@ static void remove_swap_list(struct swap_entry *entry)
     next = entry->next;
     prev->next = next;
     next->previous = prev;
+
+    hprev = &swap_hash[swap_hashfn(entry->pid, entry->page)];
+    while (*hprev != entry)
+    {
+        KASSERT(*hprev != NULL);
+        hprev = &(*hprev)->hash_next;
+    }
+    *hprev = entry->hash_next;
 }
 
 /* end list functions for swap_list */
@@ -121,8 +271,10 @@ static void remove_swap_list(struct swap_entry *entry)
 static void entry_list_init(int maxN)
 {
 
-    int i;
+    int i, j;
     struct swap_entry *tmp;
+    struct swap_slot *slot;
+    struct swap_device *d;
 
     free_list_head = kmalloc(sizeof(struct swap_entry));
     free_list_tail = kmalloc(sizeof(struct swap_entry));
@@ -132,13 +284,39 @@ static void entry_list_init(int maxN)
     swap_list->next = free_list_tail;
     swap_list->previous = NULL;
 
+    swap_hash = kmalloc(swap_buckets * sizeof(struct swap_entry *));
+    if (swap_hash == NULL)
+    {
+        panic("swap: no memory for %d entries\n", maxN);
+    }
+    for (i = 0; i < swap_buckets; i++)
+    {
+        swap_hash[i] = NULL;
+    }
+
     for (i = 0; i < maxN; i++)
     {
         tmp = kmalloc(sizeof(struct swap_entry));
         tmp->pid = -1;
-        tmp->file_offset = i * PAGE_SIZE;
+        tmp->slot = NULL;
         add_free_entry(tmp);
     }
+
+    /* each device has its own list of free slots */
+    for (i = 0; i < swap_ndevs; i++)
+    {
+        d = &swap_devs[i];
+        d->free_slots = NULL;
+        for (j = d->nslots - 1; j >= 0; j--)
+        {
+            slot = kmalloc(sizeof(struct swap_slot));
+            slot->file_offset = (off_t)j * PAGE_SIZE;
+            slot->dev = d;
+            slot->refs = 0;
+            slot->next = d->free_slots;
+            d->free_slots = slot;
+        }
+    }
 }
 
 static struct swap_entry *get_free_entry(void)
@@ -155,18 +333,78 @@ static struct swap_entry *get_free_entry(void)
     return tmp;
 }
 
+/* take a free slot of the first device with room (see swap_candidate) */
+static struct swap_slot *get_free_slot(void)
+{
+    struct swap_device *d;
+    struct swap_slot *slot;
+    int i;
+
+    for (i = 0; i < swap_ndevs; i++)
+    {
+        d = swap_candidate(i);
+        slot = d->free_slots;
+        if (slot != NULL)
+        {
+            d->free_slots = slot->next;
+            d->used++;
+            swap_rr++;
+            slot->refs = 1;
+            return slot;
+        }
+    }
+
+    panic("no free slot in swapfile");
+}
+
+/* number of a slot among the slots of all the devices */
+static int slot_number(struct swap_slot *slot)
+{
+    return slot->dev->first + slot->file_offset / PAGE_SIZE;
+}
+
+/* give back an entry out of swap_list, and its slot if no one else refers to it */
+static void put_entry(struct swap_entry *entry)
+{
+    struct swap_slot *slot = entry->slot;
+
+    KASSERT(slot->refs > 0);
+    if (--slot->refs == 0)
+    {
+        zswap_drop(slot_number(slot));
+        slot->next = slot->dev->free_slots;
+        slot->dev->free_slots = slot;
+        slot->dev->used--;
+    }
+    entry->pid = -1;
+    entry->slot = NULL;
+    add_free_entry(entry);
+}
+
+/* make the slot of entry also the one of page entry->page of pid */
+static void share_entry(struct swap_entry *entry, pid_t pid)
+{
+    struct swap_entry *copy = get_free_entry();
+
+    copy->pid = pid;
+    copy->page = entry->page;
+    copy->slot = entry->slot;
+    entry->slot->refs++;
+    add_swap_list(copy);
+}
+
 /* end list functions for free entries*/
 
 /* 
- * Initialize swapfile. If the file does not exists, it is created.
- * If the file exists, it is truncated at length 0 (content cleared).
+ * Initialize the swap area (see swap_open). If the SWAPFILE does not exist,
+ * it is created. If it exists, it is truncated at length 0 (content cleared).
  */
 void init_swapfile(void)
 {
-    int result;
-    result = vfs_open((char *)"./SWAPFILE", O_RDWR | O_CREAT | O_TRUNC, 777, &v);
-    KASSERT(result != -1);
-    entry_list_init(ENTRIES);
+    swap_entries = swap_open();
+    swap_hash_size();
+    entry_list_init(swap_entries);
+    zswap_init(swap_entries);
 }
 
 static int
@@ -203,6 +441,18 @@ file_read_paddr(struct vnode *vn, paddr_t buf_ptr, size_t size, off_t offset)
     return (nread);
 }
 
+/* tell whether a page of a process is in the swapfile, without reading it */
+int swap_present(pid_t pid, vaddr_t page)
+{
+    int present;
+
+    spinlock_acquire(&swap_lock);
+    present = search_swap_list(pid, page) != NULL;
+    spinlock_release(&swap_lock);
+
+    return present;
+}
+
 int swap_in(vaddr_t page, paddr_t paddr)
 {
 
@@ -210,7 +460,7 @@ int swap_in(vaddr_t page, paddr_t paddr)
     pid_t pid;
     pid = curproc->p_pid;
     struct swap_entry *entry;
-    off_t offset;
+    struct swap_slot *slot;
 
     /* page must be in swap file */
     spinlock_acquire(&swap_lock);
@@ -219,18 +469,27 @@ int swap_in(vaddr_t page, paddr_t paddr)
 
     if (entry != NULL)
     {
-        offset = entry->file_offset;
-        remove_swap_list(entry);
+        /* the entry stays, until the page is written (see swap_discard) */
+        slot = entry->slot;
         spinlock_release(&swap_lock);
-        result = file_read_paddr(v, paddr, PAGE_SIZE, offset);
+
+        increase(SWAP_IN_PAGE);
+        increase(FAULT_WITH_LOAD);
+        /* the compressed pool first */
+        if (zswap_load(slot_number(slot), paddr) == 0)
+        {
+            return 0;
+        }
+
+        result = file_read_paddr(slot->dev->vn, paddr, PAGE_SIZE, slot->file_offset);
         KASSERT(result == PAGE_SIZE);
 
         spinlock_acquire(&swap_lock);
-        add_free_entry(entry);
+        slot->dev->reads++;
+        slot->dev->pages_in++;
         spinlock_release(&swap_lock);
 
-        increase(SWAP_IN_PAGE);
-        increase(FAULT_WITH_LOAD);
+        increase(SWAP_IN_IO);
         return 0;
     }
 
@@ -238,6 +497,21 @@ int swap_in(vaddr_t page, paddr_t paddr)
 
     return 1;
 }
+/* the page of pid is going to be written: its slot (if any) is not valid anymore */
+void swap_discard(pid_t pid, vaddr_t page)
+{
+    struct swap_entry *entry;
+
+    spinlock_acquire(&swap_lock);
+    entry = search_swap_list(pid, page);
+    if (entry != NULL)
+    {
+        remove_swap_list(entry);
+        put_entry(entry);
+    }
+    spinlock_release(&swap_lock);
+}
+
 /*
  *  This function actually swaps out the page. In principle, there is a problem.
  *  If a process tries to swap out a page that does not own, the conversion from
@@ -298,19 +572,30 @@ int swap_out(paddr_t paddr, vaddr_t vaddr, int segment_victim, pid_t pid_victim)
     {
         return 0;
     }
-    KASSERT(curproc->p_pid == pid_victim);
+    KASSERT(pid_victim > 0);
 
     spinlock_acquire(&swap_lock);
 
     entry = get_free_entry();
     entry->page = vaddr;
     entry->pid = pid_victim;
+    entry->slot = get_free_slot();
 
     spinlock_release(&swap_lock);
-    result = file_write_paddr(v, paddr, PAGE_SIZE, entry->file_offset);
-    if (result != PAGE_SIZE)
+    /* pages that compress well stay in memory, in the compressed pool */
+    result = 0;
+    if (zswap_store(slot_number(entry->slot), paddr) != 0)
     {
-        panic("Unable to swap page out");
+        result = file_write_paddr(entry->slot->dev->vn, paddr, PAGE_SIZE, entry->slot->file_offset);
+        if (result != PAGE_SIZE)
+        {
+            panic("Unable to swap page out");
+        }
+        spinlock_acquire(&swap_lock);
+        entry->slot->dev->writes++;
+        entry->slot->dev->pages_out++;
+        spinlock_release(&swap_lock);
+        increase(SWAP_OUT_IO);
     }
     spinlock_acquire(&swap_lock);
     add_swap_list(entry);
@@ -320,6 +605,42 @@ int swap_out(paddr_t paddr, vaddr_t vaddr, int segment_victim, pid_t pid_victim)
     return 0;
 }
 
+/* swap_list entries are not contiguous in the file: write one page at a time */
+int swap_out_cluster(struct swap_page *pages, int n)
+{
+    int i, result;
+
+    for (i = 0; i < n; i++)
+    {
+        result = swap_out(pages[i].paddr, pages[i].vaddr, 0, pages[i].pid);
+        if (result)
+        {
+            return result;
+        }
+    }
+
+    return 0;
+}
+
+int swap_write_slot(int slot, paddr_t paddr)
+{
+    struct swap_device *d = swap_device_of(slot);
+    int result;
+
+    result = file_write_paddr(d->vn, paddr, PAGE_SIZE, (off_t)(slot - d->first) * PAGE_SIZE);
+    if (result != PAGE_SIZE)
+    {
+        return EIO;
+    }
+    spinlock_acquire(&swap_lock);
+    d->writes++;
+    d->pages_out++;
+    spinlock_release(&swap_lock);
+    increase(SWAP_OUT_IO);
+
+    return 0;
+}
+
 void free_swap_table(pid_t pid)
 {
 
@@ -329,7 +650,7 @@ void free_swap_table(pid_t pid)
 
     KASSERT(pid >= 0);
 
-    for (int i = 0; i < ENTRIES; i++)
+    for (int i = 0; i < swap_entries; i++)
     {
         if (tmp == free_list_tail)
         {
@@ -342,7 +663,7 @@ void free_swap_table(pid_t pid)
         if (tmp->pid == pid)
         {
             remove_swap_list(tmp);
-            add_free_entry(tmp);
+            put_entry(tmp);
         }
 
         tmp = next;
@@ -361,7 +682,7 @@ static void print_recursive(struct swap_entry *next)
         return;
     }
 
-    kprintf("%llu -   %d   - %d\n", next->file_offset / PAGE_SIZE, next->pid, next->page / PAGE_SIZE);
+    kprintf("%llu -   %d   - %d\n", next->slot->file_offset / PAGE_SIZE, next->pid, next->page / PAGE_SIZE);
 
     print_recursive(next->next);
 }
@@ -377,106 +698,294 @@ void print_swap(void)
 
     spinlock_release(&swap_lock);
 }
-// TO DO: update to new version
+/*
+ * The child of a fork refers to the same slots as the parent for the pages
+ * that are swapped out: nothing is read or written. Pages the child already
+ * has, swapped out while shared with it, are skipped.
+ */
 void duplicate_swap_pages(pid_t old_pid, pid_t new_pid)
 {
-
-    int result;
-    paddr_t paddr;
     struct swap_entry *tmp;
+
+    spinlock_acquire(&swap_lock);
+
+    /* new entries are added at the head of swap_list, before tmp */
+    for (tmp = swap_list->next; tmp != free_list_tail; tmp = tmp->next)
+    {
+        if (tmp->pid == old_pid && search_swap_list(new_pid, tmp->page) == NULL)
+        {
+            share_entry(tmp, new_pid);
+        }
+    }
+
+    spinlock_release(&swap_lock);
+}
+
+void swap_share(pid_t pid, pid_t sharer, vaddr_t page)
+{
     struct swap_entry *entry;
-    paddr = as_prepare_load(1);
 
-    /* page must be in swap file */
+    spinlock_acquire(&swap_lock);
+    entry = search_swap_list(pid, page);
+    KASSERT(entry != NULL);
+    share_entry(entry, sharer);
+    spinlock_release(&swap_lock);
+}
+
+#else
+
+int swap_fd;
+
+static struct swap_entry *swap_table;
+
+/*
+ * Index of the swapped pages: entries are chained by (pid, page) through the
+ * next field, so that swap_in does not scan the whole swap_table. Free
+ * entries are chained through next as well.
+ * Each entry refers to a slot of the swapfile; swap_refs counts the entries
+ * referring to each slot. Free slots are kept in a bitmap (set bit = free)
+ * and allocated next-fit, on each device on its own.
+ * The tables are allocated at boot, when the size of the swap area is known.
+ */
+static int *swap_hash;
+static unsigned char *swap_refs;
+static int *swap_free_map;
+static int free_entry = -1;
+
+static void SetBit(int *A, int k)
+{
+    A[k / 32] |= 1 << (k % 32);
+}
+
+static void ClearBit(int *A, int k)
+{
+    A[k / 32] &= ~(1 << (k % 32));
+}
+
+static int TestBit(int *A, int k)
+{
+    return (A[k / 32] & (1 << (k % 32))) != 0;
+}
+
+/* functions below are called with swap_lock held */
+
+static int swap_search(pid_t pid, vaddr_t page)
+{
+    int i;
 
-    while (search_swap_list_pid(old_pid, &tmp) != NULL)
+    for (i = swap_hash[swap_hashfn(pid, page)]; i != -1; i = swap_table[i].next)
     {
-        spinlock_acquire(&swap_lock);
+        if (swap_table[i].pid == pid && swap_table[i].page == page)
+        {
+            break;
+        }
+    }
 
-        entry = get_free_entry();
+    return i;
+}
 
-        spinlock_release(&swap_lock);
+static void swap_hash_insert(int i)
+{
+    int h = swap_hashfn(swap_table[i].pid, swap_table[i].page);
 
-        result = file_read_paddr(v, paddr, PAGE_SIZE, tmp->file_offset);
-        if (result != PAGE_SIZE)
+    swap_table[i].next = swap_hash[h];
+    swap_hash[h] = i;
+}
+
+static void swap_hash_remove(int i)
+{
+    int *prev = &swap_hash[swap_hashfn(swap_table[i].pid, swap_table[i].page)];
+
+    while (*prev != i)
+    {
+        KASSERT(*prev != -1);
+        prev = &swap_table[*prev].next;
+    }
+    *prev = swap_table[i].next;
+    swap_table[i].next = -1;
+}
+
+/* 
+ * next-fit: look for n contiguous free slots of device d starting after the
+ * last ones allocated, skipping 32 busy slots at a time. The slots are
+ * reserved, with no entry referring to them yet. Return the first one, -1
+ * if there are none.
+ */
+static int dev_free_run(struct swap_device *d, int n)
+{
+    int i, j, k, run = 0, end = d->first + d->nslots;
+
+    for (j = 0, i = d->next_fit; j < d->nslots; j++, i = i + 1 < end ? i + 1 : d->first)
+    {
+        if (i == d->first)
         {
-            panic("Unable to read page from swap file");
+            /* runs do not wrap around the end of the device */
+            run = 0;
         }
-        result = file_write_paddr(v, paddr, PAGE_SIZE,  tmp->file_offset);
-        if (result != PAGE_SIZE)
+        if (i % 32 == 0 && swap_free_map[i / 32] == 0 && d->nslots - j >= 32 && end - i >= 32)
         {
-            panic("Unable to swap page out for fork");
+            /* no free slot in this word */
+            run = 0;
+            j += 31;
+            i += 31;
+            continue;
         }
-        spinlock_acquire(&swap_lock);
-        entry->page = tmp->page;
-        entry->pid = new_pid;
+        if (!TestBit(swap_free_map, i))
+        {
+            run = 0;
+            continue;
+        }
+        if (++run == n)
+        {
+            for (k = i - n + 1; k <= i; k++)
+            {
+                ClearBit(swap_free_map, k);
+            }
+            d->next_fit = i + 1 < end ? i + 1 : d->first;
+            d->used += n;
+            return i - n + 1;
+        }
+    }
 
-        spinlock_release(&swap_lock);
+    return -1;
+}
 
-    }
-    spinlock_release(&swap_lock);
+/* reserve n contiguous free slots on the first device with room (see swap_candidate) */
+static int get_free_run(int n)
+{
+    int i, first;
 
+    for (i = 0; i < swap_ndevs; i++)
+    {
+        first = dev_free_run(swap_candidate(i), n);
+        if (first != -1)
+        {
+            swap_rr++;
+            return first;
+        }
+    }
 
+    return -1;
 }
 
-#else
+/* take a free entry, panic if there are none */
+static int get_entry(void)
+{
+    int i = free_entry;
 
-int swap_fd;
+    if (i == -1)
+    {
+        panic("Out of swap entries\n");
+    }
+    free_entry = swap_table[i].next;
 
-static struct swap_entry swap_table[ENTRIES];
-static struct vnode *v = NULL;
-static struct spinlock swap_lock = SPINLOCK_INITIALIZER;
+    return i;
+}
 
-static void print_swap_internal(void)
+/* give back an entry no longer in the hash, and its slot if no one else refers to it */
+static void put_entry(int i)
 {
+    int slot = swap_table[i].slot;
 
-    kprintf("<< SWAP TABLE >>\n");
-
-    for (int i = 0; i < ENTRIES; i++)
+    KASSERT(swap_refs[slot] > 0);
+    if (--swap_refs[slot] == 0)
     {
-        if (swap_table[i].pid != -1)
-        {
-            kprintf("%d -   %d   - %d\n", i, swap_table[i].pid, swap_table[i].page / PAGE_SIZE);
-        }
+        zswap_drop(slot);
+        SetBit(swap_free_map, slot);
+        swap_device_of(slot)->used--;
     }
+    swap_table[i].pid = -1;
+    swap_table[i].next = free_entry;
+    free_entry = i;
+}
+
+/* make the slot of entry i also the one of page swap_table[i].page of pid */
+static void share_entry(int i, pid_t pid)
+{
+    int j = get_entry();
+
+    KASSERT(swap_refs[swap_table[i].slot] < 255);
+    swap_table[j].pid = pid;
+    swap_table[j].page = swap_table[i].page;
+    swap_table[j].slot = swap_table[i].slot;
+    swap_refs[swap_table[j].slot]++;
+    swap_hash_insert(j);
 }
 
 /* 
- * Initialize swapfile. If the file does not exists, it is created.
- * If the file exists, it is truncated at length 0 (content cleared).
+ * Initialize the swap area (see swap_open). If the SWAPFILE does not exist,
+ * it is created. If it exists, it is truncated at length 0 (content cleared).
  */
 void init_swapfile(void)
 {
-    int i, result;
-    result = vfs_open((char *)"./SWAPFILE", O_RDWR | O_CREAT | O_TRUNC, 777, &v);
-    KASSERT(result != -1);
+    int i;
+
+    swap_entries = swap_open();
+    swap_hash_size();
+    swap_table = kmalloc(swap_entries * sizeof(struct swap_entry));
+    swap_hash = kmalloc(swap_buckets * sizeof(int));
+    swap_refs = kmalloc(swap_entries);
+    swap_free_map = kmalloc((swap_entries + 31) / 32 * sizeof(int));
+    if (swap_table == NULL || swap_hash == NULL || swap_refs == NULL || swap_free_map == NULL)
+    {
+        panic("swap: no memory for %d entries\n", swap_entries);
+    }
+    /* the bits past the last slot stay clear (busy) */
+    bzero(swap_free_map, (swap_entries + 31) / 32 * sizeof(int));
+
     spinlock_acquire(&swap_lock);
-    for (i = 0; i < ENTRIES; i++)
+    for (i = swap_entries - 1; i >= 0; i--)
     {
         swap_table[i].pid = -1;
+        swap_table[i].next = free_entry;
+        free_entry = i;
+        swap_refs[i] = 0;
+        SetBit(swap_free_map, i);
+    }
+    for (i = 0; i < swap_buckets; i++)
+    {
+        swap_hash[i] = -1;
+    }
+    for (i = 0; i < swap_ndevs; i++)
+    {
+        swap_devs[i].next_fit = swap_devs[i].first;
     }
     spinlock_release(&swap_lock);
+
+    zswap_init(swap_entries);
 }
 
-static int
-file_read_paddr(struct vnode *vn, paddr_t buf_ptr, size_t size, off_t offset)
+/*
+ * Move n pages between the frames in paddr and n contiguous slots starting
+ * at first, on the same device, with a single uio, one iovec for each frame.
+ * The frames may belong to any process: they are accessed through their
+ * kernel (KSEG0) addresses, with UIO_SYSSPACE.
+ */
+static int swap_io(paddr_t *paddr, int n, int first, enum uio_rw rw)
 {
-    struct iovec iov;
+    struct iovec iov[SWAP_CLUSTER];
     struct uio u;
-    int result, nread;
+    struct swap_device *d = swap_device_of(first);
+    int i, result;
 
-    iov.iov_ubase = (userptr_t)(PADDR_TO_KVADDR(buf_ptr));
-    iov.iov_len = size;
+    KASSERT(n > 0 && n <= SWAP_CLUSTER);
+    KASSERT(first + n <= d->first + d->nslots);
 
-    u.uio_iov = &iov;
-    u.uio_iovcnt = 1;
-    u.uio_resid = size; // amount to read from the file
-    u.uio_offset = offset;
+    for (i = 0; i < n; i++)
+    {
+        iov[i].iov_ubase = (userptr_t)(PADDR_TO_KVADDR(paddr[i]));
+        iov[i].iov_len = PAGE_SIZE;
+    }
+
+    u.uio_iov = iov;
+    u.uio_iovcnt = n;
+    u.uio_resid = n * PAGE_SIZE;
+    u.uio_offset = (off_t)(first - d->first) * PAGE_SIZE;
     u.uio_segflg = UIO_SYSSPACE;
-    u.uio_rw = UIO_READ;
+    u.uio_rw = rw;
     u.uio_space = NULL;
 
-    result = VOP_READ(vn, &u);
+    result = rw == UIO_READ ? VOP_READ(d->vn, &u) : VOP_WRITE(d->vn, &u);
     if (result)
     {
         return result;
@@ -484,85 +993,146 @@ file_read_paddr(struct vnode *vn, paddr_t buf_ptr, size_t size, off_t offset)
 
     if (u.uio_resid != 0)
     {
-        kprintf("SWAPPING IN: short read on page - problems reading?\n");
+        kprintf("SWAPPING: short transfer on %d pages - problems with %s?\n", n, d->name);
         return EFAULT;
     }
 
-    nread = size - u.uio_resid;
-    return (nread);
+    spinlock_acquire(&swap_lock);
+    if (rw == UIO_READ)
+    {
+        d->reads++;
+        d->pages_in += n;
+    }
+    else
+    {
+        d->writes++;
+        d->pages_out += n;
+    }
+    spinlock_release(&swap_lock);
+
+    return 0;
+}
+
+/* tell whether a page of a process is in the swapfile, without reading it */
+int swap_present(pid_t pid, vaddr_t page)
+{
+    int present;
+
+    spinlock_acquire(&swap_lock);
+    present = swap_search(pid, page) != -1;
+    spinlock_release(&swap_lock);
+
+    return present;
 }
 
+/*
+ * Read page of the current process from the swapfile into paddr. The pages
+ * that follow it in the address space and sit in the slots that follow its
+ * own are read with the same operation (read-ahead), if there are free frames
+ * for them: they are added to the IPT, clean, but not to the TLB.
+ * The entries stay in the swapfile (swap cache): as long as the pages are not
+ * written, their slots are still valid and they are dropped without writing
+ * them again when evicted. The caller marks the frame clean, or discards the
+ * entry with swap_discard if it is going to write the page.
+ * Return 1 if the page is not in the swapfile.
+ */
 int swap_in(vaddr_t page, paddr_t paddr)
 {
 
-    int result, i;
+    int result, i, n, k, slot, end;
     pid_t pid;
+    paddr_t frames[SWAP_CLUSTER];
+    struct swap_device *d;
     pid = curproc->p_pid;
 
+    /*
+     * only the current process reads or drops its entries (exit and fork
+     * run in the process itself), so they do not change after the lookup
+     */
     spinlock_acquire(&swap_lock);
     /* page must be in swap file */
-    for (i = 0; i < ENTRIES; i++)
+    i = swap_search(pid, page);
+    if (i == -1)
     {
-        if (swap_table[i].pid == pid && swap_table[i].page == page)
+        spinlock_release(&swap_lock);
+        return 1;
+    }
+    slot = swap_table[i].slot;
+    d = swap_device_of(slot);
+    end = d->first + d->nslots;
+
+    /* the following pages, if they are in the following slots of the same device */
+    for (n = 1; n < SWAP_CLUSTER && slot + n < end; n++)
+    {
+        i = swap_search(pid, page + n * PAGE_SIZE);
+        if (i == -1 || swap_table[i].slot != slot + n)
         {
-            spinlock_release(&swap_lock);
-            result = file_read_paddr(v, paddr, PAGE_SIZE, i * PAGE_SIZE);
+            break;
+        }
+    }
+    spinlock_release(&swap_lock);
+
+    /* the compressed pool first: no I/O, and no read-ahead */
+    if (zswap_load(slot, paddr) == 0)
+    {
+        increase(SWAP_IN_PAGE);
+        increase(FAULT_WITH_LOAD);
+        return 0;
+    }
+
+    frames[0] = paddr;
+    for (k = 1; k < n; k++)
+    {
+        /*
+         * a page being swapped out, or already read, is still in the IPT;
+         * a page in the compressed pool is not on the device yet
+         */
+        if (ipt_lookup(pid, page + k * PAGE_SIZE) != 0 || zswap_present(slot + k))
+        {
+            break;
+        }
+        frames[k] = getfreeppage();
+        if (frames[k] == 0)
+        {
+            break;
+        }
+    }
+    n = k;
+
+    result = swap_io(frames, n, slot, UIO_READ);
+    KASSERT(result == 0);
 
-            spinlock_acquire(&swap_lock);
-            swap_table[i].pid = -1;
 #if DUMPIN
-            kprintf("Swapping in PID %d PAGE %d\n", curproc->p_pid, page / PAGE_SIZE);
+    kprintf("Swapping in PID %d PAGE %d (%d pages)\n", curproc->p_pid, page / PAGE_SIZE, n);
 #endif
-            spinlock_release(&swap_lock);
 
-            KASSERT(result == PAGE_SIZE);
-            increase(SWAP_IN_PAGE);
-            increase(FAULT_WITH_LOAD);
-            return 0;
-        }
+    for (k = 1; k < n; k++)
+    {
+        ipt_add(pid, frames[k], page + k * PAGE_SIZE);
+        ipt_set_clean(frames[k], 1);
+        ipt_unlock_frame(frames[k]);
+        increase(SWAP_READAHEAD);
     }
-    spinlock_release(&swap_lock);
-    return 1;
+
+    increase(SWAP_IN_PAGE);
+    increase(SWAP_IN_IO);
+    increase(FAULT_WITH_LOAD);
+    return 0;
 }
-/*
- *  This function actually swaps out the page. In principle, there is a problem.
- *  If a process tries to swap out a page that does not own, the conversion from
- *  vaddr of that page (the victim) to paddr, is done using the address space 
- *  of the current process (the one doing the swap). This means that the translation
- *  will be incorrect, and the process will swap out a frame that is not the one 
- *  corresponding to the victmi.
- *  In order to solve the problem, we perform a write as if we are writing from kernel
- *  swap. Basically, we receive the paddr of the page to swap out, we add KSEG0, and we
- *  perform the write with UIO_SYSSPACE. In this way, the translation is done as if it was
- *  a kernel address, allowing us to perform a write using almost directly a physical address.
- */
 
-static int
-file_write_paddr(struct vnode *vn, paddr_t buf_ptr, size_t size, off_t offset)
+/* the page of pid is going to be written: its slot (if any) is not valid anymore */
+void swap_discard(pid_t pid, vaddr_t page)
 {
-    struct iovec iov;
-    struct uio u;
-    int result, nwrite;
-
-    iov.iov_ubase = (userptr_t)(PADDR_TO_KVADDR(buf_ptr));
-    iov.iov_len = size;
-
-    u.uio_iov = &iov;
-    u.uio_iovcnt = 1;
-    u.uio_resid = size; // amount to read from the file
-    u.uio_offset = offset;
-    u.uio_segflg = UIO_SYSSPACE;
-    u.uio_rw = UIO_WRITE;
-    u.uio_space = NULL;
+    int i;
 
-    result = VOP_WRITE(vn, &u);
-    if (result)
+    spinlock_acquire(&swap_lock);
+    i = swap_search(pid, page);
+    if (i != -1)
     {
-        return result;
+        swap_hash_remove(i);
+        put_entry(i);
     }
-
-    nwrite = size - u.uio_resid;
-    return (nwrite);
+    spinlock_release(&swap_lock);
 }
 
 /*
@@ -575,8 +1145,7 @@ file_write_paddr(struct vnode *vn, paddr_t buf_ptr, size_t size, off_t offset)
 
 int swap_out(paddr_t paddr, vaddr_t vaddr, int segment_victim, pid_t pid_victim)
 {
-
-    int result, i;
+    struct swap_page page;
 
     KASSERT(pid_victim != -1);
 
@@ -586,41 +1155,106 @@ int swap_out(paddr_t paddr, vaddr_t vaddr, int segment_victim, pid_t pid_victim)
         return 0;
     }
 
+    page.paddr = paddr;
+    page.vaddr = vaddr;
+    page.pid = pid_victim;
+
+    return swap_out_cluster(&page, 1);
+}
+
+/*
+ * Write n pages (at most SWAP_CLUSTER) to contiguous slots of the swapfile,
+ * with a single I/O operation.
+ */
+int swap_out_cluster(struct swap_page *pages, int n)
+{
+    int result, i, j, first;
+    paddr_t frames[SWAP_CLUSTER];
+
+    KASSERT(n > 0 && n <= SWAP_CLUSTER);
+
     spinlock_acquire(&swap_lock);
-    /* iterate though the swap_table to find a free entry */
-    for (i = 0; i < ENTRIES; i++)
+    /* get free slots, reserved so that no one else can select them as free */
+    first = get_free_run(n);
+    spinlock_release(&swap_lock);
+
+    if (first == -1)
     {
-        /* if pid of entry is -1, it is free */
-        if (swap_table[i].pid == -1)
+        if (n == 1)
+        {
+            panic("Out of swapspace\n");
+        }
+        /* no room for the whole cluster: write one page at a time */
+        for (i = 0; i < n; i++)
         {
-            /* set pid of entry to -2, so that no one else can select the entry as free */
-            swap_table[i].pid = -2;
+            result = swap_out_cluster(&pages[i], 1);
+            if (result)
+            {
+                return result;
+            }
+        }
+        return 0;
+    }
 
 #if DUMPOUT
-            kprintf("Start swapping out PID %d PAGE %d\n", pid_victim, vaddr / PAGE_SIZE);
+    kprintf("Start swapping out PID %d PAGE %d (%d pages)\n", pages[0].pid, pages[0].vaddr / PAGE_SIZE, n);
 #endif
-            spinlock_release(&swap_lock);
-            /* actually write on file */
-            result = file_write_paddr(v, paddr, PAGE_SIZE, i * PAGE_SIZE);
-            spinlock_acquire(&swap_lock);
-            if (result != PAGE_SIZE)
+    for (i = 0; i < n; i++)
+    {
+        KASSERT(pages[i].pid > 0);
+        frames[i] = pages[i].paddr;
+    }
+
+    /*
+     * pages that compress well stay in memory, in the compressed pool; the
+     * runs of the other ones are actually written on the device
+     */
+    for (i = 0; i < n; i = j + 1)
+    {
+        /* the run ends at the first page stored in the pool (j), or at the end */
+        for (j = i; j < n && zswap_store(first + j, frames[j]) != 0; j++)
+            ;
+        if (j > i)
+        {
+            result = swap_io(&frames[i], j - i, first + i, UIO_WRITE);
+            if (result)
             {
                 panic("Unable to swap page out");
             }
+            increase(SWAP_OUT_IO);
+        }
+    }
 
-            KASSERT(result >= 0);
+    spinlock_acquire(&swap_lock);
+    for (i = 0; i < n; i++)
+    {
+        j = get_entry();
+        swap_table[j].pid = pages[i].pid;
+        swap_table[j].page = pages[i].vaddr;
+        swap_table[j].slot = first + i;
+        swap_refs[first + i] = 1;
+        swap_hash_insert(j);
+    }
+    spinlock_release(&swap_lock);
 
-            swap_table[i].pid = pid_victim;
-            swap_table[i].page = vaddr;
+    for (i = 0; i < n; i++)
+    {
+        increase(SWAP_OUT_PAGE);
+    }
+    return 0;
+}
 
-            spinlock_release(&swap_lock);
-            increase(SWAP_OUT_PAGE);
-            return 0;
-        }
+int swap_write_slot(int slot, paddr_t paddr)
+{
+    int result;
+
+    result = swap_io(&paddr, 1, slot, UIO_WRITE);
+    if (result == 0)
+    {
+        increase(SWAP_OUT_IO);
     }
-    spinlock_release(&swap_lock);
 
-    panic("Out of swapspace\n");
+    return result;
 }
 
 void free_swap_table(pid_t pid)
@@ -629,11 +1263,12 @@ void free_swap_table(pid_t pid)
 
     KASSERT(pid >= 0);
 
-    for (int i = 0; i < ENTRIES; i++)
+    for (int i = 0; i < swap_entries; i++)
     {
         if (swap_table[i].pid == pid)
         {
-            swap_table[i].pid = -1;
+            swap_hash_remove(i);
+            put_entry(i);
         }
     }
 
@@ -647,61 +1282,46 @@ void print_swap(void)
 
     kprintf("<< SWAP TABLE >>\n");
 
-    for (int i = 0; i < ENTRIES; i++)
+    for (int i = 0; i < swap_entries; i++)
     {
-        kprintf("%d -   %d   - %d\n", i, swap_table[i].pid, swap_table[i].page / PAGE_SIZE);
+        if (swap_table[i].pid != -1)
+        {
+            kprintf("%d -   %d   - %d\n", swap_table[i].slot, swap_table[i].pid, swap_table[i].page / PAGE_SIZE);
+        }
     }
 
     spinlock_release(&swap_lock);
 }
 
+/*
+ * The child of a fork refers to the same slots as the parent for the pages
+ * that are swapped out: nothing is read or written. Pages the child already
+ * has, swapped out while shared with it, are skipped.
+ */
 void duplicate_swap_pages(pid_t old_pid, pid_t new_pid)
 {
-
-    int result, i, j;
-    paddr_t paddr;
-
-    paddr = as_prepare_load(1);
+    int i;
 
     spinlock_acquire(&swap_lock);
-    /* page must be in swap file */
-    for (i = 0; i < ENTRIES; i++)
+    for (i = 0; i < swap_entries; i++)
     {
-        if (swap_table[i].pid == old_pid)
+        if (swap_table[i].pid == old_pid && swap_search(new_pid, swap_table[i].page) == -1)
         {
-            for (j = 0; j < ENTRIES; j++)
-            {
-                if (swap_table[j].pid == -1)
-                {
-                    swap_table[j].pid = new_pid;
-                    swap_table[j].page = swap_table[i].page;
-                    print_swap_internal();
-                    spinlock_release(&swap_lock);
-
-                    result = file_read_paddr(v, paddr, PAGE_SIZE, i * PAGE_SIZE);
-                    if (result != PAGE_SIZE)
-                    {
-                        panic("Unable to read page from swap file");
-                    }
-                    result = file_write_paddr(v, paddr, PAGE_SIZE, j * PAGE_SIZE);
-                    if (result != PAGE_SIZE)
-                    {
-                        panic("Unable to swap page out for fork");
-                    }
-                    spinlock_acquire(&swap_lock);
-
-                    KASSERT(result >= 0);
-                    break;
-                }
-            }
-            if (j == ENTRIES)
-            {
-                panic("Swap file is full");
-            }
+            share_entry(i, new_pid);
         }
     }
     spinlock_release(&swap_lock);
-    freeppages(paddr, paddr / PAGE_SIZE);
+}
+
+void swap_share(pid_t pid, pid_t sharer, vaddr_t page)
+{
+    int i;
+
+    spinlock_acquire(&swap_lock);
+    i = swap_search(pid, page);
+    KASSERT(i != -1);
+    share_entry(i, sharer);
+    spinlock_release(&swap_lock);
 }
 
 #endif
@@ -16,37 +16,183 @@
 #include <swapfile.h>
 #include <syscall.h>
 #include <instrumentation.h>
+#include <pt.h>
+#include <coremap.h>
+#include <membar.h>
 
 /* under dumbvm, always have 72k of user stack */
 /* (this must be > 64K so argument blocks of size ARG_MAX will fit) */
 #define DUMBVM_STACKPAGES 18
 
-static struct spinlock tlb_fault_lock = SPINLOCK_INITIALIZER;
+/*
+ * Address space ids. Entries are tagged with the 6-bit ASID of their address
+ * space, so that they survive context switches. ASID 0 is never given out.
+ * ASIDs are not given back: when they run out, a new generation starts and
+ * every address space gets a new ASID the next time it runs. A cpu flushes
+ * its TLB the first time it sees a new generation.
+ * An address space that moves to another cpu gets a new ASID as well: the
+ * entries it left on the old cpu may be stale, and will never match again.
+ */
+#define NUM_ASID 64
+#define ASID_SHIFT 6
+#define ASID_MAXCPUS 32
 
+static struct spinlock asid_lock = SPINLOCK_INITIALIZER;
+static uint32_t asid_generation = 1;
+static uint32_t asid_next = 1;
+/* last generation seen by each cpu and ASID it is running with */
+static uint32_t asid_cpu_generation[ASID_MAXCPUS];
+static uint32_t asid_cpu_current[ASID_MAXCPUS];
 
-static void update_tlb(vaddr_t faultaddress, paddr_t paddr)
+/*
+ * Software TLB: a direct-mapped cache, per cpu, of the translations this
+ * cpu has recently put in the TLB, so that a TLB miss on a page that is
+ * still in memory is served without the page table. It works as a second
+ * level of the TLB: an entry is tagged with the EntryHi that was written
+ * (vaddr | ASID) and holds its EntryLo, tag 0 is an empty entry. Like the
+ * TLB it is flushed when the cpu sees a new ASID generation, and entries
+ * are removed together with their TLB entry, by their own cpu: it is only
+ * touched with interrupts off, and needs no lock.
+ * Most misses are served by the UTLB refill handler (exception-mips1.S),
+ * which looks here before building a trapframe; its layout, a row of
+ * STLB_SIZE 8-byte entries per cpu, must match the code there.
+ */
+#define STLB_SIZE 128
+
+struct stlb_entry
 {
+	uint32_t tag;
+	uint32_t elo;
+};
 
-	int i;
-	uint32_t ehi, elo;
-	uint32_t ehi1, elo1;
-	int victim;
-	int spl;
-	/* Disable interrupts on this CPU while frobbing the TLB. */
+struct stlb_entry stlb[ASID_MAXCPUS][STLB_SIZE];
+
+/*
+ * A frame of zeros, shared by all the stack and BSS pages that have only
+ * been read so far: they are mapped on it read-only, with no IPT entry, and
+ * get a frame of their own at the first write.
+ */
+static paddr_t zero_paddr;
+
+/* fault-around window, in pages */
+static int faultaround_window = FAULTAROUND_PAGES;
+/* TLB misses served by the refill handler, counted by the handler itself */
+uint32_t utlb_refills[ASID_MAXCPUS];
+
+static unsigned stlb_index(uint32_t ehi)
+{
+	return ((ehi ^ (ehi >> 6)) >> 6) % STLB_SIZE;
+}
 
-	ehi = faultaddress;
+/* called with interrupts disabled */
+static void stlb_invalidate(uint32_t ehi)
+{
+	struct stlb_entry *e = &stlb[curcpu->c_number][stlb_index(ehi)];
 
-	if (address_segment(faultaddress, curproc->p_addrspace) == 1)
+	if (e->tag == ehi)
 	{
-		elo = (paddr & ~TLBLO_DIRTY) | TLBLO_VALID;
+		e->tag = 0;
 	}
-	else
+}
+
+long utlb_refill_count(void)
+{
+	long n = 0;
+	unsigned cpu;
+
+	for (cpu = 0; cpu < ASID_MAXCPUS; cpu++)
 	{
-		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
+		n += utlb_refills[cpu];
 	}
 
+	return n;
+}
+
+/* tlb_read, tlb_write and tlb_probe overwrite EntryHi, whose ASID is the one matched */
+static void tlb_restore_asid(void)
+{
+	uint32_t ehi = asid_cpu_current[curcpu->c_number] << ASID_SHIFT;
+
+	__asm volatile("mtc0 %0, $10" : : "r" (ehi));
+}
+
+void tlb_activate(struct addrspace *as)
+{
+	unsigned cpu;
+	int i, spl, flush = 0;
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
 
+	cpu = curcpu->c_number;
+	KASSERT(cpu < ASID_MAXCPUS);
+
+	spinlock_acquire(&asid_lock);
+	if (as->as_asid_gen != asid_generation || as->as_asid_cpu != curcpu)
+	{
+		if (asid_next == NUM_ASID)
+		{
+			asid_generation++;
+			asid_next = 1;
+		}
+		as->as_asid = asid_next++;
+		as->as_asid_gen = asid_generation;
+		as->as_asid_cpu = curcpu;
+	}
+	if (asid_cpu_generation[cpu] != asid_generation)
+	{
+		asid_cpu_generation[cpu] = asid_generation;
+		flush = 1;
+	}
+	asid_cpu_current[cpu] = as->as_asid;
+	spinlock_release(&asid_lock);
+
+	if (flush)
+	{
+		for (i = 0; i < NUM_TLB; i++)
+		{
+			tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+		}
+		for (i = 0; i < STLB_SIZE; i++)
+		{
+			stlb[cpu][i].tag = 0;
+		}
+	}
+	tlb_restore_asid();
+
+	splx(spl);
+
+	if (flush)
+	{
+		increase(TLB_INVALIDATION);
+	}
+}
+
+
+/*
+ * Write a translation in the TLB. Called with interrupts disabled.
+ * If it is written for a TLB fault (miss), the fault is counted as served
+ * with a free entry or replacing one: a write on a page mapped read-only on
+ * the zero page replaces its entry.
+ */
+static void tlb_insert(uint32_t ehi, uint32_t elo, int miss)
+{
+	int i;
+	uint32_t ehi1, elo1;
+	int victim;
+
+	/* write on a copy-on-write page: replace its read-only entry */
+	i = tlb_probe(ehi, 0);
+	if (i >= 0)
+	{
+		if (miss)
+		{
+			increase(TLB_MISS_FULL);
+		}
+		tlb_write(ehi, elo, i);
+		return;
+	}
+
 	/* add entry in the TLB */
 	for (i = 0; i < NUM_TLB; i++)
 	{
@@ -56,7 +202,10 @@ static void update_tlb(vaddr_t faultaddress, paddr_t paddr)
 			continue;
 		}
 
-		increase(TLB_MISS_FREE);
+		if (miss)
+		{
+			increase(TLB_MISS_FREE);
+		}
 		tlb_write(ehi, elo, i);
 
 		break;
@@ -66,19 +215,493 @@ static void update_tlb(vaddr_t faultaddress, paddr_t paddr)
 	{
 		/*select a victim to be replaced*/
 		victim = tlb_get_rr_victim();
+		if (miss)
+		{
+			increase(TLB_MISS_FULL);
+		}
 		tlb_write(ehi, elo, victim);
 	}
+}
+
+/*
+ * Write the translation of a page that has not been touched yet, only in a
+ * free TLB slot: it does not evict entries that are in use. Called with
+ * interrupts disabled. Return 1 if it is in the TLB.
+ */
+static int tlb_insert_free(uint32_t ehi, uint32_t elo)
+{
+	int i;
+	uint32_t ehi1, elo1;
+
+	i = tlb_probe(ehi, 0);
+	if (i >= 0)
+	{
+		tlb_write(ehi, elo, i);
+		return 1;
+	}
+
+	for (i = 0; i < NUM_TLB; i++)
+	{
+		tlb_read(&ehi1, &elo1, i);
+		if (!(elo1 & TLBLO_VALID))
+		{
+			tlb_write(ehi, elo, i);
+			return 1;
+		}
+	}
+	tlb_restore_asid();
+
+	return 0;
+}
+
+/*
+ * How map_page() writes a translation: for a TLB fault, for a write on a
+ * read-only entry (copy-on-write or clean page, not a TLB fault) or in
+ * advance, around a fault (see tlb_faultaround()).
+ */
+#define MAP_MISS 0
+#define MAP_WRITE 1
+#define MAP_AROUND 2
+
+static int map_page(vaddr_t faultaddress, paddr_t paddr, int writable, int how)
+{
+	uint32_t ehi, elo;
+	struct stlb_entry *e;
+	int spl, mapped = 1;
+	/* text pages and pages shared copy-on-write are read-only */
+	if (!writable)
+	{
+		elo = (paddr & ~TLBLO_DIRTY) | TLBLO_VALID;
+	}
+	else
+	{
+		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
+	}
+
+	/* Disable interrupts on this CPU while frobbing the TLB. */
+	spl = splhigh();
+
+	ehi = faultaddress | (asid_cpu_current[curcpu->c_number] << ASID_SHIFT);
+	if (how == MAP_AROUND)
+	{
+		mapped = tlb_insert_free(ehi, elo);
+	}
+	else
+	{
+		tlb_insert(ehi, elo, how == MAP_MISS);
+	}
+
+	/* remember it for the next miss */
+	e = &stlb[curcpu->c_number][stlb_index(ehi)];
+	e->tag = ehi;
+	e->elo = elo;
+
+	splx(spl);
+
+	return mapped;
+}
+
+static void update_tlb(vaddr_t faultaddress, paddr_t paddr, int writable)
+{
+	map_page(faultaddress, paddr, writable, MAP_MISS);
+}
+
+/*
+ * TLB miss on a page found in the software TLB of this cpu: put the
+ * translation back in the TLB. A write on a read-only entry takes the
+ * slow path (it may be copy-on-write). Return 1 if done.
+ */
+static int stlb_reload(vaddr_t faultaddress, int write)
+{
+	struct stlb_entry *e;
+	uint32_t ehi;
+	int spl, hit;
+
+	spl = splhigh();
+	ehi = faultaddress | (asid_cpu_current[curcpu->c_number] << ASID_SHIFT);
+	e = &stlb[curcpu->c_number][stlb_index(ehi)];
+	hit = e->tag == ehi && (!write || (e->elo & TLBLO_DIRTY));
+	if (hit)
+	{
+		tlb_insert(ehi, e->elo, 1);
+	}
+	splx(spl);
+
+	return hit;
+}
+
+/* called with interrupts disabled */
+static void tlb_invalidate_asid(uint32_t asid, vaddr_t vaddr)
+{
+	int tlb_entry;
+
+	stlb_invalidate(vaddr | (asid << ASID_SHIFT));
+	tlb_entry = tlb_probe(vaddr | (asid << ASID_SHIFT), 0);
+	if (tlb_entry >= 0)
+	{
+		tlb_write(TLBHI_INVALID(tlb_entry), TLBLO_INVALID(), tlb_entry);
+	}
+	tlb_restore_asid();
+}
+
+void tlb_invalidate_vaddr(vaddr_t vaddr)
+{
+	int spl;
+
+	spl = splhigh();
+	tlb_invalidate_asid(asid_cpu_current[curcpu->c_number], vaddr);
+	splx(spl);
+}
+
+/*
+ * Entries of other processes are not flushed at context switch anymore:
+ * remove them when their page goes away. They can only be on the cpu where
+ * the process got its ASID: if it is another one, send it a shootdown and
+ * wait for it to be done, as the caller is going to reuse the frame.
+ * No spinlock can be held, the other cpu may be spinning on it.
+ */
+void tlb_invalidate_pid(pid_t pid, vaddr_t vaddr)
+{
+	struct proc *p;
+	struct addrspace *as;
+	struct cpu *target = NULL;
+	struct tlbshootdown ts;
+	volatile int done = 0;
+	int spl;
+
+	p = proc_search_pid(pid);
+	as = p != NULL ? p->p_addrspace : NULL;
+	if (as == NULL)
+	{
+		/* not running yet or already gone: nothing in the TLB */
+		return;
+	}
+
+	spl = splhigh();
+
+	spinlock_acquire(&asid_lock);
+	if (as->as_asid_cpu != NULL && as->as_asid_gen == asid_cpu_generation[as->as_asid_cpu->c_number])
+	{
+		target = as->as_asid_cpu;
+		ts.ts_asid = as->as_asid;
+	}
+	spinlock_release(&asid_lock);
+
+	if (target == curcpu)
+	{
+		tlb_invalidate_asid(ts.ts_asid, vaddr);
+	}
+	splx(spl);
+
+	if (target != NULL && target != curcpu)
+	{
+		ts.ts_vaddr = vaddr;
+		ts.ts_done = &done;
+		ipi_tlbshootdown(target, &ts);
+		/*
+		 * Spinning is safe: no spinlock is held, so the target is never
+		 * waiting for us, and interrupts are enabled, so a shootdown sent
+		 * to us meanwhile is served. Every sender waits for its shootdown
+		 * before sending another, so at most one per sender is queued,
+		 * below TLBSHOOTDOWN_MAX.
+		 */
+		while (!done)
+		{
+		}
+		membar_any_any();
+	}
+}
+
+void tlb_invalidate_pid_local(pid_t pid, vaddr_t vaddr)
+{
+	struct proc *p;
+	struct addrspace *as;
+	uint32_t asid = 0;
+	int spl;
+
+	p = proc_search_pid(pid);
+	as = p != NULL ? p->p_addrspace : NULL;
+	if (as == NULL)
+	{
+		return;
+	}
+
+	spl = splhigh();
+
+	spinlock_acquire(&asid_lock);
+	if (as->as_asid_cpu == curcpu && as->as_asid_gen == asid_cpu_generation[curcpu->c_number])
+	{
+		asid = as->as_asid;
+	}
+	spinlock_release(&asid_lock);
+
+	if (asid != 0)
+	{
+		tlb_invalidate_asid(asid, vaddr);
+	}
+
 	splx(spl);
 }
 
+void zero_page_bootstrap(void)
+{
+	vaddr_t kvaddr;
+
+	/* zero-filled, and never freed nor swapped out (kernel frame) */
+	kvaddr = alloc_kpages(1);
+	if (kvaddr == 0)
+	{
+		panic("vm: cannot allocate the zero page\n");
+	}
+	zero_paddr = kvaddr - MIPS_KSEG0;
+}
+
+/*
+ * Read fault on a page that was never written: map it on the zero page.
+ * A write will find it read-only and not in the IPT, and will be handled as
+ * a miss, getting a zero-filled frame.
+ */
+static void map_zero_page(vaddr_t faultaddress)
+{
+	increase(NEW_PAGE_ZEROED);
+	increase(ZERO_PAGE_MAP);
+	update_tlb(faultaddress, zero_paddr, 0);
+}
+
+/* a clean frame (see ipt_set_clean) locked by the caller is going to be written */
+static void mark_dirty(pid_t pid, vaddr_t faultaddress, paddr_t paddr, int flags)
+{
+	if (flags & IPT_CLEAN)
+	{
+		ipt_set_clean(paddr, 0);
+		swap_discard(pid, faultaddress);
+	}
+}
+
+/*
+ * A data or stack page just read from the swapfile keeps its slot, and a data
+ * page just read from the ELF file can be read again: as long as it is not
+ * written, it can be evicted without writing it. A read fault maps it
+ * read-only to catch the first write; a write fault (also a read-only fault
+ * retried as a miss) gives up the slot, if any, at once.
+ * Return whether the page can be mapped writable.
+ */
+static int keep_clean(int faulttype, vaddr_t faultaddress, paddr_t paddr)
+{
+	if (faulttype != VM_FAULT_READ)
+	{
+		swap_discard(curproc->p_pid, faultaddress);
+		return 1;
+	}
+	ipt_set_clean(paddr, 1);
+	return 0;
+}
+
+/* give back a frame obtained with as_prepare_load() that has not been used */
+static void free_page(paddr_t paddr)
+{
+	freeppages(paddr, paddr / PAGE_SIZE);
+	ipt_kadd(-1, paddr, 0);
+}
+
+/*
+ * ELF fault on the page at page_offset_from_segbase, to be loaded in
+ * frames[0]: take frames for the following pages of the segment, as long
+ * as they are whole pages of file data and are not in memory (nor in the
+ * swapfile, for data pages), so that load_pages() reads them together.
+ * Only free frames are used, nothing is evicted for them. They are added
+ * to the IPT locked (text pages to the text hash as well), so that no one
+ * else loads them meanwhile.
+ * Return the number of frames to load, the faulting one included.
+ */
+static int readaround_frames(paddr_t *frames, vaddr_t page_offset_from_segbase, vaddr_t faultaddress, int segment)
+{
+	struct addrspace *as = curproc->p_addrspace;
+	pid_t pid = curproc->p_pid;
+	int n, window = faultaround_window;
+	vaddr_t vaddr;
+
+	for (n = 1; n < window; n++)
+	{
+		vaddr = faultaddress + n * PAGE_SIZE;
+		if (!load_page_fills_frame(page_offset_from_segbase + n * PAGE_SIZE, segment) ||
+			ipt_lookup(pid, vaddr) != 0 || (segment != 1 && swap_present(pid, vaddr)))
+		{
+			break;
+		}
+		frames[n] = getfreeppage();
+		if (frames[n] == 0)
+		{
+			break;
+		}
+		if (segment == 1)
+		{
+			if (ipt_text_add(pid, frames[n], vaddr, as->as_vnode))
+			{
+				/* someone else is loading it */
+				free_page(frames[n]);
+				break;
+			}
+		}
+		else
+		{
+			ipt_add(pid, frames[n], vaddr);
+		}
+	}
+
+	return n;
+}
+
+/*
+ * Unlock the pages read together with the faulting one. Data pages are
+ * clean, like a data page read on a read fault (see keep_clean). If the
+ * read failed, nobody must find them: they are removed from the IPT and
+ * freed.
+ */
+static void readaround_done(paddr_t *frames, int n, int segment, int loaded)
+{
+	int k;
+
+	for (k = 1; k < n; k++)
+	{
+		if (!loaded)
+		{
+			ipt_drop_frame(frames[k]);
+			free_page(frames[k]);
+			continue;
+		}
+		if (segment != 1)
+		{
+			ipt_set_clean(frames[k], 1);
+		}
+		ipt_unlock_frame(frames[k]);
+	}
+}
+
+/*
+ * Put in the TLB the translations of the resident pages of the same segment
+ * in the aligned window around faultaddress, so that the next accesses to
+ * them do not miss. Only free TLB slots are used, and busy frames are
+ * skipped. Clean and shared pages are mapped read-only, as on a reload.
+ * The pages are marked referenced (see ipt_trylock_frame): accesses through
+ * these entries do not fault, and would not tell the clock they are used.
+ */
+static void tlb_faultaround(vaddr_t faultaddress, int segment)
+{
+	struct addrspace *as = curproc->p_addrspace;
+	int i, flags, window = faultaround_window;
+	vaddr_t base, vaddr;
+	paddr_t paddr;
+
+	base = faultaddress - (faultaddress / PAGE_SIZE % window) * PAGE_SIZE;
+	for (i = 0; i < window; i++)
+	{
+		vaddr = base + i * PAGE_SIZE;
+		if (vaddr == faultaddress || address_segment(vaddr, as) != segment)
+		{
+			continue;
+		}
+		paddr = ipt_trylock_frame(curproc->p_pid, vaddr, &flags);
+		if (paddr == 0)
+		{
+			continue;
+		}
+		if (map_page(vaddr, paddr, segment != 1 && !(flags & (IPT_SHARED | IPT_CLEAN)), MAP_AROUND))
+		{
+			increase(FAULT_AROUND_MAP);
+		}
+		ipt_unlock_frame(paddr);
+	}
+}
+
+int faultaround_set_window(int pages)
+{
+	if (pages < 1 || pages > FAULTAROUND_MAX)
+	{
+		return EINVAL;
+	}
+	faultaround_window = pages;
+
+	return 0;
+}
+
+void faultaround_print_window(void)
+{
+	kprintf("Fault-around window: %d pages\n", faultaround_window);
+}
+
+/*
+ * A write on a data or stack page that is mapped read-only because it is
+ * shared copy-on-write after a fork: give the process its own copy.
+ * If the other processes already got theirs, the page is simply made writable.
+ * A clean page (still valid in the swapfile) is mapped read-only as well:
+ * the write makes it dirty, and its slot is given up.
+ * Return 1 if the page is not in memory anymore (it has been swapped out
+ * meanwhile): the caller has to handle it as a TLB miss.
+ */
+static int cow_fault(vaddr_t faultaddress)
+{
+	paddr_t paddr, newpaddr = 0;
+	pid_t pid = curproc->p_pid;
+	int flags;
+
+	for (;;)
+	{
+		/* the frame is locked while it is copied: no one can swap it out */
+		paddr = ipt_lock_frame(pid, faultaddress, &flags);
+		if (paddr == 0 || !(flags & IPT_SHARED) || newpaddr != 0)
+		{
+			break;
+		}
+		/* getting a frame may require a swap out: cannot hold the frame */
+		ipt_unlock_frame(paddr);
+		newpaddr = as_prepare_load(1, ALLOC_OVERWRITE);
+		KASSERT(newpaddr != 0);
+	}
+
+	if (paddr != 0 && (flags & IPT_SHARED))
+	{
+		increase(COW_FAULT);
+		memmove((void *)PADDR_TO_KVADDR(newpaddr),
+				(const void *)PADDR_TO_KVADDR(paddr),
+				PAGE_SIZE);
+		ipt_unshare(pid, paddr, faultaddress);
+		ipt_unlock_frame(paddr);
+		/* the frame stays clean for the others, the copy is dirty */
+		if (flags & IPT_CLEAN)
+		{
+			swap_discard(pid, faultaddress);
+		}
+		ipt_add(pid, newpaddr, faultaddress);
+		map_page(faultaddress, newpaddr, 1, MAP_WRITE);
+		ipt_unlock_frame(newpaddr);
+
+		return 0;
+	}
+
+	if (paddr != 0)
+	{
+		/* last user of the frame, or first write on a clean page */
+		increase(flags & IPT_CLEAN ? CLEAN_PAGE_WRITE : COW_FAULT);
+		mark_dirty(pid, faultaddress, paddr, flags);
+		map_page(faultaddress, paddr, 1, MAP_WRITE);
+		ipt_unlock_frame(paddr);
+	}
+
+	if (newpaddr != 0)
+	{
+		free_page(newpaddr);
+	}
+
+	return paddr == 0;
+}
+
 int address_segment(vaddr_t faultaddress, struct addrspace *as)
 {
 
 	vaddr_t vbase1, vtop1, vbase2, vtop2, stackbase, stacktop;
 	int segment;
 
-	KASSERT(as == curproc->p_addrspace);
-
 	/* Assert that the address space has been set up properly. */
 	KASSERT(as != NULL);
 	KASSERT(as->as_vbase1 != 0);
@@ -125,6 +748,9 @@ int vm_fault(int faulttype, vaddr_t faultaddress)
 	struct addrspace *as;
 	int segment;
 	int result;
+	int flags;
+	int in_swap, intent, writable, n, private_text;
+	paddr_t frames[FAULTAROUND_MAX];
 
 	faultaddress &= PAGE_FRAME;
 
@@ -133,13 +759,6 @@ int vm_fault(int faulttype, vaddr_t faultaddress)
 	switch (faulttype)
 	{
 	case VM_FAULT_READONLY:
-		/* We always create pages read-write, so we can't get this */
-		/* terminate the process instead of panicking */
-		kprintf("VM_FAULT_READONLY: process exited\n");
-		sys__exit(-1);
-
-		/* should not get here */
-		panic("VM: got VM_FAULT_READONLY, should not get here\n");
 	case VM_FAULT_READ:
 	case VM_FAULT_WRITE:
 		break;
@@ -167,6 +786,15 @@ int vm_fault(int faulttype, vaddr_t faultaddress)
 		return EFAULT;
 	}
 
+	/* a page this cpu has recently mapped: no need to look at the page table */
+	if (faulttype != VM_FAULT_READONLY && stlb_reload(faultaddress, faulttype == VM_FAULT_WRITE))
+	{
+		increase(TLB_MISS);
+		increase(TLB_RELOAD);
+		increase(STLB_HIT);
+		return 0;
+	}
+
 	/* get in which segment the faulting address is */
 	segment = address_segment(faultaddress, as);
 	if (segment == EFAULT)
@@ -180,11 +808,33 @@ int vm_fault(int faulttype, vaddr_t faultaddress)
 		return EFAULT;
 	}
 
+	if (faulttype == VM_FAULT_READONLY)
+	{
+		if (segment == 1)
+		{
+			/* text pages are read-only */
+			/* terminate the process instead of panicking */
+			kprintf("VM_FAULT_READONLY: process exited\n");
+			sys__exit(-1);
+
+			/* should not get here */
+			panic("VM: got VM_FAULT_READONLY, should not get here\n");
+		}
+		if (cow_fault(faultaddress) == 0)
+		{
+			return 0;
+		}
+	}
+
 	increase(TLB_MISS);
 
-	spinlock_acquire(&tlb_fault_lock);
-	/* check if page is in memory */
-	paddr = ipt_lookup(curproc->p_pid, faultaddress);
+retry:
+	/*
+	 * check if page is in memory. The frame is locked while it goes in the
+	 * TLB, so that no one can swap it out meanwhile; if someone else holds it
+	 * (it is being swapped out or loaded), wait for it
+	 */
+	paddr = ipt_lock_frame(curproc->p_pid, faultaddress, &flags);
 
 	/* if it is in memory, paddr will be different than 0 */
 
@@ -204,11 +854,40 @@ int vm_fault(int faulttype, vaddr_t faultaddress)
 			 * we find the offset from the segment base 
 			 */
 			page_offset_from_segbase = faultaddress - (segment == 1 ? as->as_vbase1 : as->as_vbase2);
-			spinlock_release(&tlb_fault_lock);
+
+			/* code pages may be already in memory, loaded by another process running the same program */
+			private_text = 0;
+			if (segment == 1)
+			{
+				result = ipt_text_lookup(curproc->p_pid, as->as_vnode, faultaddress, &paddr);
+				if (result == 0)
+				{
+					increase(TLB_RELOAD);
+					update_tlb(faultaddress, paddr, 0);
+					ipt_unlock_frame(paddr);
+
+					goto mapped;
+				}
+				/* no alias left to share the frame: load a copy of the page that only this process maps */
+				private_text = result == ENOMEM;
+			}
+
+			/*
+			 * a page read from the swapfile, or a whole page read from the ELF,
+			 * overwrites the frame: there is no need to zero it
+			 */
+			in_swap = segment != 1 && swap_present(curproc->p_pid, faultaddress);
+			if (segment == 2 && !in_swap && faulttype == VM_FAULT_READ && load_page_is_zero(page_offset_from_segbase, segment))
+			{
+				/* BSS page never written */
+				map_zero_page(faultaddress);
+				goto mapped;
+			}
+			intent = in_swap || load_page_fills_frame(page_offset_from_segbase, segment) ? ALLOC_OVERWRITE : ALLOC_ZERO;
 
 			/* as_prepare_load is a wrapper for getppages() -> will allocate a page and return the offset */
 
-			paddr = as_prepare_load(1);
+			paddr = as_prepare_load(1, intent);
 			KASSERT(paddr != 0);
 
 			/* make sure it's page-aligned */
@@ -216,56 +895,97 @@ int vm_fault(int faulttype, vaddr_t faultaddress)
 
 			/* look in the swapfile (if the faulting address is not in code segment) */
 
-			if (segment != 1)
+			if (in_swap)
 			{
 				result = swap_in(faultaddress, paddr);
+				KASSERT(result == 0);
+			}
+			else if (segment != 1)
+			{
+				result = 1;
+			}
+			else if (private_text)
+			{
+				ipt_add(curproc->p_pid, paddr, faultaddress);
+				result = 1;
 			}
 			else
 			{
+				/* other processes faulting on the page wait for it to be loaded */
+				if (ipt_text_add(curproc->p_pid, paddr, faultaddress, as->as_vnode))
+				{
+					/* someone else is loading it */
+					free_page(paddr);
+					goto retry;
+				}
 				result = 1;
 			}
 
 			as_complete_load(curproc->p_addrspace);
 			if (result)
 			{
-				/* load page at vaddr = faultaddress if not in swapfile */
-
-				result = load_page(page_offset_from_segbase, faultaddress, segment, paddr);
+				/* load page at vaddr = faultaddress if not in swapfile, and the following ones with it */
+				frames[0] = paddr;
+				n = private_text ? 1 : readaround_frames(frames, page_offset_from_segbase, faultaddress, segment);
+				result = load_pages(page_offset_from_segbase, segment, frames, n);
+				readaround_done(frames, n, segment, result == 0);
 				if (result)
 				{
+					/* a data page is added to the IPT only once loaded */
+					if (segment == 1)
+					{
+						ipt_drop_frame(paddr);
+					}
+					free_page(paddr);
 					return -1;
 				}
 			}
-			spinlock_acquire(&tlb_fault_lock);
-			result = ipt_add(curproc->p_pid, paddr, faultaddress);
 
-			if (result)
+			writable = segment != 1;
+			if (segment != 1)
 			{
-				return -1;
-			}
+				result = ipt_add(curproc->p_pid, paddr, faultaddress);
 
-			update_tlb(faultaddress, paddr);
+				if (result)
+				{
+					return -1;
+				}
+				writable = keep_clean(faulttype, faultaddress, paddr);
+			}
 
-			spinlock_release(&tlb_fault_lock);
+			update_tlb(faultaddress, paddr, writable);
 
-			return 0;
+			ipt_unlock_frame(paddr);
 		}
 		else
 		{
-			spinlock_release(&tlb_fault_lock);
+			/*
+			 * a stack page never touched before is mapped on the zero page
+			 * when read, and gets a zero-filled frame, from the pool if
+			 * possible, when written
+			 */
+			in_swap = swap_present(curproc->p_pid, faultaddress);
+			if (!in_swap && faulttype == VM_FAULT_READ)
+			{
+				map_zero_page(faultaddress);
+				goto mapped;
+			}
 
 			/* as_prepare_load is a wrapper for getppages() -> will allocate a page and return the offset */
-			paddr = as_prepare_load(1);
+			paddr = as_prepare_load(1, in_swap ? ALLOC_OVERWRITE : ALLOC_ZERO);
 
 			/* make sure it's page-aligned */
 			KASSERT((paddr & PAGE_FRAME) == paddr);
 
-			result = swap_in(faultaddress, paddr);
-			if (result)
+			if (in_swap)
+			{
+				result = swap_in(faultaddress, paddr);
+				KASSERT(result == 0);
+			}
+			else
 			{
 				increase(NEW_PAGE_ZEROED);
 			}
-			spinlock_acquire(&tlb_fault_lock);
 
 			KASSERT(paddr != 0);
 		
@@ -276,12 +996,10 @@ int vm_fault(int faulttype, vaddr_t faultaddress)
 				return -1;
 			}
 
-			update_tlb(faultaddress, paddr);
+			update_tlb(faultaddress, paddr, in_swap ? keep_clean(faulttype, faultaddress, paddr) : 1);
 
-			spinlock_release(&tlb_fault_lock);
+			ipt_unlock_frame(paddr);
 		}
-
-		return 0;
 	}
 	else
 	{
@@ -290,11 +1008,28 @@ int vm_fault(int faulttype, vaddr_t faultaddress)
 		/* make sure it's page-aligned */
 		KASSERT((paddr & PAGE_FRAME) == paddr);
 		
-		update_tlb(faultaddress, paddr);
-		spinlock_release(&tlb_fault_lock);
-
-		return 0;
+		writable = segment != 1 && !(flags & IPT_SHARED);
+		if (writable && (flags & IPT_CLEAN))
+		{
+			/* a clean page becomes writable only when it is written */
+			if (faulttype != VM_FAULT_READ)
+			{
+				mark_dirty(curproc->p_pid, faultaddress, paddr, flags);
+			}
+			else
+			{
+				writable = 0;
+			}
+		}
+		update_tlb(faultaddress, paddr, writable);
+		ipt_unlock_frame(paddr);
 	}
+
+mapped:
+	/* the pages around are likely to be accessed next */
+	tlb_faultaround(faultaddress, segment);
+
+	return 0;
 }
 
 /*Select a victim on the TLB using a Round Robin algorithm*/
@@ -304,11 +1039,12 @@ int tlb_get_rr_victim(void)
 	static unsigned int next_victim = 0;
 	victim = next_victim;
 	next_victim = (next_victim + 1) % NUM_TLB;
-	increase(TLB_MISS_FULL);
 	return victim;
 }
+/* a page of a process that got its ASID on this cpu has been taken away */
 void vm_tlbshootdown(const struct tlbshootdown *ts)
 {
-	(void)ts;
-	panic("dumbvm tried to do tlb shootdown?!\n");
+	tlb_invalidate_asid(ts->ts_asid, ts->ts_vaddr);
+	membar_any_any();
+	*ts->ts_done = 1;
 }
\ No newline at end of file
@@ -0,0 +1,502 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <wchan.h>
+#include <vm.h>
+#include <swapfile.h>
+#include <zswap.h>
+
+/* the codec finds repeated sequences of at least LZ_MINMATCH bytes */
+#define LZ_MINMATCH 4
+#define ZSWAP_HASH_BITS 10
+#define ZSWAP_HASH_SIZE (1 << ZSWAP_HASH_BITS)
+
+/*
+ * A compressed page in the pool, followed by its data. Records are 16-byte
+ * aligned, so that the end of the pool is always large enough for a header.
+ */
+struct zswap_record
+{
+    /* slot of the page, -1 if it is gone (or the record is just padding) */
+    int slot;
+    /* bytes of the record, header included, and of the compressed page */
+    int size, len;
+    /* being written back to the swap device */
+    int busy;
+};
+
+/* where a page is compressed */
+struct zswap_buffer
+{
+    int busy;
+    uint16_t table[ZSWAP_HASH_SIZE];
+    unsigned char data[ZSWAP_MAX_SIZE];
+};
+
+static struct spinlock zswap_lock = SPINLOCK_INITIALIZER;
+/* who waits for a buffer or for a write back sleeps here, under zswap_lock */
+static struct wchan *zswap_wchan;
+
+/* records, from the oldest (tail) to the newest (head), wrapping around */
+static char *zswap_pool;
+static int zswap_head, zswap_tail, zswap_used;
+/* offset in the pool of the record of each slot, -1 if none */
+static int *zswap_where;
+
+static struct zswap_buffer *zswap_buffers;
+/*
+ * A page is written back at a time, decompressed in zswap_page; the slot
+ * being written back is zswap_wb_slot, -1 if none.
+ */
+static char *zswap_page;
+static int zswap_wb_slot = -1;
+
+/* statistics */
+static long int zswap_stored, zswap_rejected, zswap_written, zswap_hits, zswap_misses;
+static long int zswap_bytes_in, zswap_bytes_out;
+
+static uint32_t lz_read32(const unsigned char *p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+/* extension bytes of a length: 255 means that more follow */
+static int lz_putlen(unsigned char *dst, int op, int limit, int len)
+{
+    for (; len >= 255; len -= 255)
+    {
+        if (op >= limit)
+        {
+            return -1;
+        }
+        dst[op++] = 255;
+    }
+    if (op >= limit)
+    {
+        return -1;
+    }
+    dst[op++] = len;
+
+    return op;
+}
+
+/*
+ * Append a sequence: a token (4 bits of literal count, 4 bits of match
+ * length), the literals, then the distance of the match (2 bytes) and the
+ * extension bytes of its length. The last sequence (mlen == 0) has no match.
+ * Return the new output length, -1 if it exceeds limit.
+ */
+static int lz_sequence(unsigned char *dst, int op, int limit, const unsigned char *lit, int nlit, int offset, int mlen)
+{
+    int token;
+
+    if (op >= limit)
+    {
+        return -1;
+    }
+    token = op++;
+    dst[token] = (nlit < 15 ? nlit : 15) << 4;
+    if (nlit >= 15 && (op = lz_putlen(dst, op, limit, nlit - 15)) < 0)
+    {
+        return -1;
+    }
+    if (op + nlit > limit)
+    {
+        return -1;
+    }
+    memcpy(dst + op, lit, nlit);
+    op += nlit;
+    if (mlen == 0)
+    {
+        return op;
+    }
+
+    if (op + 2 > limit)
+    {
+        return -1;
+    }
+    dst[op++] = offset & 0xff;
+    dst[op++] = offset >> 8;
+    mlen -= LZ_MINMATCH;
+    dst[token] |= mlen < 15 ? mlen : 15;
+    if (mlen >= 15 && (op = lz_putlen(dst, op, limit, mlen - 15)) < 0)
+    {
+        return -1;
+    }
+
+    return op;
+}
+
+/*
+ * Compress a page: each position is looked up in a hash of the last
+ * positions where its first 4 bytes were seen, and the match found there is
+ * extended as far as it goes. Return the compressed length, -1 if it would
+ * exceed limit.
+ */
+static int lz_compress(const unsigned char *src, unsigned char *dst, int limit, uint16_t *table)
+{
+    int ip = 0, anchor = 0, op = 0, ref, len;
+    uint32_t seq;
+    unsigned h;
+
+    /* positions are stored + 1, 0 means none */
+    bzero(table, ZSWAP_HASH_SIZE * sizeof(uint16_t));
+    while (ip + LZ_MINMATCH <= PAGE_SIZE)
+    {
+        seq = lz_read32(src + ip);
+        h = (seq * 2654435769U) >> (32 - ZSWAP_HASH_BITS);
+        ref = table[h] - 1;
+        table[h] = ip + 1;
+        if (ref < 0 || lz_read32(src + ref) != seq)
+        {
+            ip++;
+            continue;
+        }
+        for (len = LZ_MINMATCH; ip + len < PAGE_SIZE && src[ref + len] == src[ip + len]; len++)
+            ;
+        op = lz_sequence(dst, op, limit, src + anchor, ip - anchor, ip - ref, len);
+        if (op < 0)
+        {
+            return -1;
+        }
+        ip += len;
+        anchor = ip;
+    }
+
+    return lz_sequence(dst, op, limit, src + anchor, PAGE_SIZE - anchor, 0, 0);
+}
+
+static void lz_decompress(const unsigned char *src, int len, unsigned char *dst)
+{
+    int ip = 0, op = 0, token, n, offset, b;
+
+    while (ip < len)
+    {
+        token = src[ip++];
+        n = token >> 4;
+        if (n == 15)
+        {
+            do
+            {
+                b = src[ip++];
+                n += b;
+            } while (b == 255);
+        }
+        KASSERT(op + n <= PAGE_SIZE);
+        memcpy(dst + op, src + ip, n);
+        ip += n;
+        op += n;
+        if (ip >= len)
+        {
+            /* last sequence */
+            break;
+        }
+
+        offset = src[ip] | src[ip + 1] << 8;
+        ip += 2;
+        n = token & 15;
+        if (n == 15)
+        {
+            do
+            {
+                b = src[ip++];
+                n += b;
+            } while (b == 255);
+        }
+        n += LZ_MINMATCH;
+        KASSERT(offset > 0 && offset <= op && op + n <= PAGE_SIZE);
+        /* the match may overlap the bytes it produces: copy byte by byte */
+        for (; n > 0; n--, op++)
+        {
+            dst[op] = dst[op - offset];
+        }
+    }
+
+    KASSERT(op == PAGE_SIZE);
+}
+
+void zswap_init(int nslots)
+{
+    int i;
+
+    zswap_pool = kmalloc(ZSWAP_POOL_PAGES * PAGE_SIZE);
+    zswap_where = kmalloc(nslots * sizeof(int));
+    zswap_buffers = kmalloc(ZSWAP_BUFFERS * sizeof(struct zswap_buffer));
+    zswap_page = kmalloc(PAGE_SIZE);
+    zswap_wchan = wchan_create("zswap");
+    if (zswap_pool == NULL || zswap_where == NULL || zswap_buffers == NULL || zswap_page == NULL || zswap_wchan == NULL)
+    {
+        panic("zswap: out of memory\n");
+    }
+    /* swapped out through the KSEG0 address of the frame, like any page */
+    KASSERT(((vaddr_t)zswap_page & PAGE_FRAME) == (vaddr_t)zswap_page);
+
+    for (i = 0; i < nslots; i++)
+    {
+        zswap_where[i] = -1;
+    }
+    for (i = 0; i < ZSWAP_BUFFERS; i++)
+    {
+        zswap_buffers[i].busy = 0;
+    }
+    zswap_head = zswap_tail = zswap_used = 0;
+}
+
+static struct zswap_record *zswap_record_at(int off)
+{
+    return (struct zswap_record *)(zswap_pool + off);
+}
+
+/* give back the room of the oldest records, as long as they are gone */
+static void zswap_trim(void)
+{
+    struct zswap_record *r;
+
+    KASSERT(spinlock_do_i_hold(&zswap_lock));
+    while (zswap_used > 0)
+    {
+        r = zswap_record_at(zswap_tail);
+        if (r->slot != -1 || r->busy)
+        {
+            break;
+        }
+        zswap_tail = (zswap_tail + r->size) % (ZSWAP_POOL_PAGES * PAGE_SIZE);
+        zswap_used -= r->size;
+    }
+    if (zswap_used == 0)
+    {
+        zswap_head = zswap_tail = 0;
+    }
+}
+
+/*
+ * Take room for a record of size bytes at the head. A record does not wrap
+ * around the end of the pool: the end is filled with padding if it is too
+ * small. Return its offset, -1 if there is no room.
+ */
+static int zswap_reserve(int size)
+{
+    int pad = 0, off;
+
+    KASSERT(spinlock_do_i_hold(&zswap_lock));
+    if (zswap_head + size > ZSWAP_POOL_PAGES * PAGE_SIZE)
+    {
+        pad = ZSWAP_POOL_PAGES * PAGE_SIZE - zswap_head;
+    }
+    if (zswap_used + pad + size > ZSWAP_POOL_PAGES * PAGE_SIZE)
+    {
+        return -1;
+    }
+    if (pad > 0)
+    {
+        zswap_record_at(zswap_head)->slot = -1;
+        zswap_record_at(zswap_head)->size = pad;
+        zswap_record_at(zswap_head)->busy = 0;
+        zswap_used += pad;
+        zswap_head = 0;
+    }
+    off = zswap_head;
+    zswap_head = (zswap_head + size) % (ZSWAP_POOL_PAGES * PAGE_SIZE);
+    zswap_used += size;
+
+    return off;
+}
+
+/*
+ * Write the oldest page of the pool to its slot, to make room. If another
+ * thread is already writing one back, just wait for it.
+ */
+static void zswap_writeback(void)
+{
+    struct zswap_record *r;
+    int slot, result;
+
+    spinlock_acquire(&zswap_lock);
+    zswap_trim();
+    if (zswap_wb_slot != -1 || zswap_used == 0)
+    {
+        if (zswap_wb_slot != -1)
+        {
+            wchan_sleep(zswap_wchan, &zswap_lock);
+        }
+        spinlock_release(&zswap_lock);
+        return;
+    }
+    /* with no write back going on, the tail is a page */
+    r = zswap_record_at(zswap_tail);
+    KASSERT(r->slot != -1 && !r->busy);
+    r->busy = 1;
+    slot = zswap_wb_slot = r->slot;
+    spinlock_release(&zswap_lock);
+
+    /* a busy record is neither moved nor overwritten */
+    lz_decompress((unsigned char *)(r + 1), r->len, (unsigned char *)zswap_page);
+    result = swap_write_slot(slot, (paddr_t)zswap_page - MIPS_KSEG0);
+    if (result)
+    {
+        panic("zswap: unable to write back slot %d\n", slot);
+    }
+
+    spinlock_acquire(&zswap_lock);
+    r->busy = 0;
+    /* the slot may have been freed (and reused) meanwhile */
+    if (r->slot != -1)
+    {
+        zswap_where[r->slot] = -1;
+        r->slot = -1;
+    }
+    zswap_wb_slot = -1;
+    zswap_written++;
+    zswap_trim();
+    wchan_wakeall(zswap_wchan, &zswap_lock);
+    spinlock_release(&zswap_lock);
+}
+
+static struct zswap_buffer *zswap_get_buffer(void)
+{
+    int i;
+
+    spinlock_acquire(&zswap_lock);
+    for (;;)
+    {
+        for (i = 0; i < ZSWAP_BUFFERS; i++)
+        {
+            if (!zswap_buffers[i].busy)
+            {
+                zswap_buffers[i].busy = 1;
+                spinlock_release(&zswap_lock);
+                return &zswap_buffers[i];
+            }
+        }
+        wchan_sleep(zswap_wchan, &zswap_lock);
+    }
+}
+
+static void zswap_put_buffer(struct zswap_buffer *b)
+{
+    spinlock_acquire(&zswap_lock);
+    b->busy = 0;
+    wchan_wakeall(zswap_wchan, &zswap_lock);
+    spinlock_release(&zswap_lock);
+}
+
+/*
+ * The page is compressed outside of the lock, into one of the buffers, and
+ * copied into the pool once there is room for it. A page that does not
+ * compress well is written by the caller: if an old content of the slot
+ * (freed and given out again) is still being written back, the write must
+ * wait for it.
+ */
+int zswap_store(int slot, paddr_t paddr)
+{
+    struct zswap_buffer *b;
+    struct zswap_record *r;
+    int len, size, off;
+
+    b = zswap_get_buffer();
+    len = lz_compress((const unsigned char *)PADDR_TO_KVADDR(paddr), b->data, ZSWAP_MAX_SIZE, b->table);
+    if (len < 0)
+    {
+        zswap_put_buffer(b);
+        spinlock_acquire(&zswap_lock);
+        zswap_rejected++;
+        while (zswap_wb_slot == slot)
+        {
+            wchan_sleep(zswap_wchan, &zswap_lock);
+        }
+        spinlock_release(&zswap_lock);
+        return 1;
+    }
+
+    size = ROUNDUP(sizeof(struct zswap_record) + len, sizeof(struct zswap_record));
+    spinlock_acquire(&zswap_lock);
+    KASSERT(zswap_where[slot] == -1);
+    while ((off = zswap_reserve(size)) == -1)
+    {
+        spinlock_release(&zswap_lock);
+        zswap_writeback();
+        spinlock_acquire(&zswap_lock);
+    }
+    r = zswap_record_at(off);
+    r->slot = slot;
+    r->size = size;
+    r->len = len;
+    r->busy = 0;
+    memcpy(r + 1, b->data, len);
+    zswap_where[slot] = off;
+    zswap_stored++;
+    zswap_bytes_in += PAGE_SIZE;
+    zswap_bytes_out += len;
+    b->busy = 0;
+    wchan_wakeall(zswap_wchan, &zswap_lock);
+    spinlock_release(&zswap_lock);
+
+    return 0;
+}
+
+/*
+ * The caller has an entry referring to slot, so it cannot be dropped; the
+ * page is decompressed with the lock held, so that it is not written back
+ * and overwritten meanwhile.
+ */
+int zswap_load(int slot, paddr_t paddr)
+{
+    struct zswap_record *r;
+
+    spinlock_acquire(&zswap_lock);
+    if (zswap_where[slot] == -1)
+    {
+        zswap_misses++;
+        spinlock_release(&zswap_lock);
+        return 1;
+    }
+    r = zswap_record_at(zswap_where[slot]);
+    lz_decompress((unsigned char *)(r + 1), r->len, (unsigned char *)PADDR_TO_KVADDR(paddr));
+    zswap_hits++;
+    spinlock_release(&zswap_lock);
+
+    return 0;
+}
+
+int zswap_present(int slot)
+{
+    int present;
+
+    spinlock_acquire(&zswap_lock);
+    present = zswap_where[slot] != -1;
+    spinlock_release(&zswap_lock);
+
+    return present;
+}
+
+void zswap_drop(int slot)
+{
+    spinlock_acquire(&zswap_lock);
+    if (zswap_where[slot] != -1)
+    {
+        zswap_record_at(zswap_where[slot])->slot = -1;
+        zswap_where[slot] = -1;
+        zswap_trim();
+    }
+    spinlock_release(&zswap_lock);
+}
+
+void print_zswap_statistics(void)
+{
+    long int ratio, hits;
+
+    spinlock_acquire(&zswap_lock);
+    ratio = zswap_bytes_out > 0 ? zswap_bytes_in * 100 / zswap_bytes_out : 0;
+    hits = zswap_hits + zswap_misses > 0 ? zswap_hits * 100 / (zswap_hits + zswap_misses) : 0;
+    kprintf("Compressed Pages Stored: %ld             \n", zswap_stored);
+    kprintf("----------------------------------------\n");
+    kprintf("Incompressible Pages: %ld                \n", zswap_rejected);
+    kprintf("----------------------------------------\n");
+    kprintf("Compressed Pages Written Back: %ld       \n", zswap_written);
+    kprintf("----------------------------------------\n");
+    kprintf("Compression Ratio: %ld.%02ld              \n", ratio / 100, ratio % 100);
+    kprintf("----------------------------------------\n");
+    kprintf("Compressed Pool Hit Rate: %ld%%          \n", hits);
+    spinlock_release(&zswap_lock);
+}